@@ -0,0 +1,329 @@
+#include "game.h"
+
+#include <string.h>
+
+#define BENCH_DEFAULT_FRAMES 600
+#define BENCH_DEFAULT_WARMUP 30
+#define BENCH_TIMESTEP (1.0 / 60.0)
+#define BENCH_DEFAULT_TOLERANCE 0.10
+
+typedef struct bench_result {
+  uint32_t frames;
+  uint16_t width;
+  uint16_t height;
+  int threads;
+  int kernel;
+  int clear_mode;
+  int depth_format;
+
+  double min_ms;
+  double mean_ms;
+  double p50_ms;
+  double p99_ms;
+
+  double triangles_per_sec;
+  double pixels_per_sec;
+  uint64_t models_culled_per_frame;
+  uint64_t triangles_culled_per_frame;
+  uint64_t triangles_per_frame;
+  uint64_t pixels_per_frame;
+
+  uint32_t checksum;
+} bench_result;
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, uint32_t count, double p) {
+  uint32_t i = (uint32_t)(p * (count - 1) + 0.5);
+  return sorted[i < count ? i : count - 1];
+}
+
+static uint32_t checksum_display(SDL_display *display) {
+  uint32_t hash = 2166136261u;
+  size_t len = (size_t)display->buffer_width * display->buffer_height * 3;
+  uint8_t *rgb = (uint8_t *)malloc(len);
+  if (!rgb)
+    return 0;
+
+  read_display_pixels(display, rgb);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= rgb[i];
+    hash *= 16777619u;
+  }
+  free(rgb);
+  return hash;
+}
+
+static void write_json(FILE *f, const bench_result *r) {
+  fprintf(f, "{\n");
+  fprintf(f, "  \"frames\": %u,\n", r->frames);
+  fprintf(f, "  \"width\": %u,\n", r->width);
+  fprintf(f, "  \"height\": %u,\n", r->height);
+  fprintf(f, "  \"threads\": %d,\n", r->threads);
+  fprintf(f, "  \"kernel\": %d,\n", r->kernel);
+  fprintf(f, "  \"clear_mode\": %d,\n", r->clear_mode);
+  fprintf(f, "  \"depth_format\": %d,\n", r->depth_format);
+  fprintf(f, "  \"timestep\": %.6f,\n", BENCH_TIMESTEP);
+  fprintf(f, "  \"min_ms\": %.4f,\n", r->min_ms);
+  fprintf(f, "  \"mean_ms\": %.4f,\n", r->mean_ms);
+  fprintf(f, "  \"p50_ms\": %.4f,\n", r->p50_ms);
+  fprintf(f, "  \"p99_ms\": %.4f,\n", r->p99_ms);
+  fprintf(f, "  \"triangles_per_sec\": %.1f,\n", r->triangles_per_sec);
+  fprintf(f, "  \"pixels_per_sec\": %.1f,\n", r->pixels_per_sec);
+  fprintf(f, "  \"models_culled_per_frame\": %llu,\n",
+          (unsigned long long)r->models_culled_per_frame);
+  fprintf(f, "  \"triangles_culled_per_frame\": %llu,\n",
+          (unsigned long long)r->triangles_culled_per_frame);
+  fprintf(f, "  \"triangles_per_frame\": %llu,\n",
+          (unsigned long long)r->triangles_per_frame);
+  fprintf(f, "  \"pixels_per_frame\": %llu,\n",
+          (unsigned long long)r->pixels_per_frame);
+  fprintf(f, "  \"checksum\": %u\n", r->checksum);
+  fprintf(f, "}\n");
+}
+
+static int read_json_number(const char *json, const char *key, double *out) {
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char *at = strstr(json, pattern);
+  if (!at)
+    return false;
+  return sscanf(at + strlen(pattern), "%lf", out) == 1;
+}
+
+// Returns non-zero if the run regressed past the tolerance against the
+// baseline file. A checksum mismatch is reported but is not a regression on
+// its own: intentional rasterization changes move it too.
+static int compare_baseline(const char *path, const bench_result *r,
+                            double tolerance) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "benchmark: cannot open baseline %s\n", path);
+    return true;
+  }
+  char json[4096];
+  size_t len = fread(json, 1, sizeof(json) - 1, f);
+  json[len] = '\0';
+  fclose(f);
+
+  double base_mean, base_p99, base_checksum;
+  if (!read_json_number(json, "mean_ms", &base_mean) ||
+      !read_json_number(json, "p99_ms", &base_p99)) {
+    fprintf(stderr, "benchmark: malformed baseline %s\n", path);
+    return true;
+  }
+
+  int regressed = false;
+  if (r->mean_ms > base_mean * (1.0 + tolerance)) {
+    fprintf(stderr, "benchmark: mean %.4f ms regressed from %.4f ms\n",
+            r->mean_ms, base_mean);
+    regressed = true;
+  }
+  if (r->p99_ms > base_p99 * (1.0 + tolerance)) {
+    fprintf(stderr, "benchmark: p99 %.4f ms regressed from %.4f ms\n",
+            r->p99_ms, base_p99);
+    regressed = true;
+  }
+  if (read_json_number(json, "checksum", &base_checksum) &&
+      (uint32_t)base_checksum != r->checksum)
+    fprintf(stderr, "benchmark: frame checksum %u differs from baseline %u\n",
+            r->checksum, (uint32_t)base_checksum);
+
+  return regressed;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s [--frames N] [--warmup N] [--width W] [--height H]\n"
+          "          [--threads N] [--kernel 0=auto|1=scalar|2=sse41|3=avx2]\n"
+          "          [--clear 0=immediate|1=deferred]\n"
+          "          [--depth 0=unorm32|1=float32|2=float32rev|3=unorm16]\n"
+          "          [--out FILE] [--baseline FILE] [--tolerance FRACTION]\n"
+          "          [--capture FILE] [--replay FILE]\n",
+          name);
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t frames = BENCH_DEFAULT_FRAMES;
+  uint32_t warmup = BENCH_DEFAULT_WARMUP;
+  uint16_t width = DEFAULT_BUFFER_WIDTH;
+  uint16_t height = DEFAULT_BUFFER_HEIGHT;
+  const char *out_path = NULL;
+  const char *baseline_path = NULL;
+  const char *capture_path = NULL;
+  const char *replay_path = NULL;
+  int threads = 0;
+  int kernel = RASTER_KERNEL_AUTO;
+  int clear_mode = DISPLAY_CLEAR_IMMEDIATE;
+  int depth_format = DEPTH_UNORM32;
+  double tolerance = BENCH_DEFAULT_TOLERANCE;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return 2;
+    }
+    if (strcmp(argv[i], "--frames") == 0)
+      frames = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--warmup") == 0)
+      warmup = (uint32_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--width") == 0)
+      width = (uint16_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--height") == 0)
+      height = (uint16_t)atoi(argv[++i]);
+    else if (strcmp(argv[i], "--out") == 0)
+      out_path = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0)
+      baseline_path = argv[++i];
+    else if (strcmp(argv[i], "--tolerance") == 0)
+      tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "--threads") == 0)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--kernel") == 0)
+      kernel = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--clear") == 0)
+      clear_mode = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--depth") == 0)
+      depth_format = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--capture") == 0)
+      capture_path = argv[++i];
+    else if (strcmp(argv[i], "--replay") == 0)
+      replay_path = argv[++i];
+    else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (frames == 0 || (capture_path && replay_path)) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  SDL_display *display = allocate_display_headless(width, height);
+  if (!display)
+    return 1;
+  set_display_thread_count(display, threads);
+  set_display_clear_mode(display, clear_mode);
+  if (!set_display_depth_format(display, depth_format)) {
+    deallocate_display(display);
+    return 1;
+  }
+  kernel = select_raster_kernel(kernel);
+
+  init_game();
+
+  // A replay runs the captured frames instead of the game, once each after
+  // warming up on them in a loop. A capture records the measured frames.
+  command_buffer *replayed = NULL;
+  command_buffer *captured = NULL;
+  if (replay_path) {
+    replayed = load_command_buffers(replay_path, game_command_table(), &frames);
+    if (!replayed) {
+      deallocate_display(display);
+      return 1;
+    }
+  }
+  double *frame_ms = (double *)malloc(frames * sizeof(double));
+  if (capture_path)
+    captured = (command_buffer *)calloc(frames, sizeof(command_buffer));
+  if (!frame_ms || (capture_path && !captured)) {
+    printf("Heap allocation error: main()\n");
+    free(frame_ms);
+    free(captured);
+    deallocate_display(display);
+    return 1;
+  }
+
+  for (uint32_t i = 0; i < warmup; i++) {
+    if (replayed) {
+      execute_command_buffer(display, &replayed[i % frames]);
+    } else {
+      update_game_scripted(BENCH_TIMESTEP, i);
+      update_graphics(display);
+    }
+    cycle_display(display);
+  }
+
+  reset_render_stats();
+  double freq = (double)SDL_GetPerformanceFrequency();
+  double total_ms = 0.0;
+
+  for (uint32_t i = 0; i < frames; i++) {
+    if (!replayed)
+      update_game_scripted(BENCH_TIMESTEP, warmup + i);
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (replayed) {
+      execute_command_buffer(display, &replayed[i]);
+    } else if (captured) {
+      record_graphics(&captured[i]);
+      execute_command_buffer(display, &captured[i]);
+    } else {
+      update_graphics(display);
+    }
+    cycle_display(display);
+    Uint64 end = SDL_GetPerformanceCounter();
+
+    frame_ms[i] = (double)(end - start) * 1000.0 / freq;
+    total_ms += frame_ms[i];
+  }
+
+  render_stats stats = get_render_stats();
+
+  bench_result result = {0};
+  result.frames = frames;
+  result.width = display->buffer_width;
+  result.height = display->buffer_height;
+  result.threads = threads;
+  result.kernel = kernel;
+  result.clear_mode = clear_mode;
+  result.depth_format = depth_format;
+  result.mean_ms = total_ms / frames;
+  result.models_culled_per_frame = stats.models_culled / frames;
+  result.triangles_culled_per_frame = stats.triangles_culled / frames;
+  result.triangles_per_frame = stats.triangles_submitted / frames;
+  result.pixels_per_frame = stats.pixels_shaded / frames;
+  result.triangles_per_sec = stats.triangles_submitted / (total_ms / 1000.0);
+  result.pixels_per_sec = stats.pixels_shaded / (total_ms / 1000.0);
+  result.checksum = checksum_display(display);
+
+  qsort(frame_ms, frames, sizeof(double), compare_double);
+  result.min_ms = frame_ms[0];
+  result.p50_ms = percentile(frame_ms, frames, 0.50);
+  result.p99_ms = percentile(frame_ms, frames, 0.99);
+
+  write_json(stdout, &result);
+  if (out_path) {
+    FILE *f = fopen(out_path, "wb");
+    if (f) {
+      write_json(f, &result);
+      fclose(f);
+    } else {
+      fprintf(stderr, "benchmark: cannot write %s\n", out_path);
+    }
+  }
+
+  int status = 0;
+  if (baseline_path && compare_baseline(baseline_path, &result, tolerance))
+    status = 1;
+  if (captured &&
+      !save_command_buffers(captured, frames, game_command_table(),
+                            capture_path))
+    status = 1;
+
+  for (uint32_t i = 0; i < frames; i++) {
+    if (captured)
+      deallocate_command_buffer(&captured[i]);
+    if (replayed)
+      deallocate_command_buffer(&replayed[i]);
+  }
+  free(captured);
+  free(replayed);
+  free(frame_ms);
+  deallocate_game();
+  deallocate_display(display);
+  return status;
+}
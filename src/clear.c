@@ -0,0 +1,51 @@
+#include "graphics.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Fills below this size are left to ordinary stores: the buffer still fits in
+// cache and the rasterizer is about to read it back. Larger fills are streamed
+// past the cache so clearing does not evict the scene's working set.
+#define FILL_STREAM_MIN_BYTES (1u << 20)
+
+void fill_u32(uint32_t *dst, uint32_t value, size_t count) {
+#if defined(__SSE2__)
+  if (count * sizeof(uint32_t) >= FILL_STREAM_MIN_BYTES) {
+    while (count > 0 && ((uintptr_t)dst & 15)) {
+      *dst++ = value;
+      count--;
+    }
+    __m128i v = _mm_set1_epi32((int)value);
+    for (; count >= 16; count -= 16, dst += 16) {
+      _mm_stream_si128((__m128i *)dst, v);
+      _mm_stream_si128((__m128i *)(dst + 4), v);
+      _mm_stream_si128((__m128i *)(dst + 8), v);
+      _mm_stream_si128((__m128i *)(dst + 12), v);
+    }
+    // Streaming stores are weakly ordered; make them visible before any
+    // other thread rasterizes into the buffer.
+    _mm_sfence();
+  }
+#endif
+  for (size_t i = 0; i < count; i++)
+    dst[i] = value;
+}
+
+void fill_rect_u32(uint32_t *dst, int pitch, bbox2i rect, uint32_t value) {
+  size_t width = (size_t)(rect.max[0] - rect.min[0] + 1);
+  for (int y = rect.min[1]; y <= rect.max[1]; y++) {
+    uint32_t *row = dst + (size_t)y * pitch + rect.min[0];
+    for (size_t x = 0; x < width; x++)
+      row[x] = value;
+  }
+}
+
+void fill_rect_u16(uint16_t *dst, int pitch, bbox2i rect, uint16_t value) {
+  size_t width = (size_t)(rect.max[0] - rect.min[0] + 1);
+  for (int y = rect.min[1]; y <= rect.max[1]; y++) {
+    uint16_t *row = dst + (size_t)y * pitch + rect.min[0];
+    for (size_t x = 0; x < width; x++)
+      row[x] = value;
+  }
+}
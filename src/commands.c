@@ -0,0 +1,555 @@
+#include "display.h"
+
+#define VARIFYHEAP(ptr, str, type)                                             \
+  do {                                                                         \
+    if (!(ptr)) {                                                              \
+      printf("Heap allocation error: %s\n", str);                              \
+      return type;                                                             \
+    }                                                                          \
+  } while (0)
+
+// A command file is this header, then for each buffer its size in bytes
+// as a uint64_t followed by its commands, with every reference replaced by
+// its position in the command_table plus one, or 0 for NULL. Commands are
+// stored as laid out in memory, so the file also records the size of the
+// largest command structures to turn away captures from other builds.
+#define COMMAND_FILE_MAGIC "SRCMDS\0"
+#define COMMAND_FILE_VERSION 1
+#define COMMAND_FILE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t buffer_count;
+  uint16_t model_command_size;
+  uint16_t instance_size;
+} command_file_header;
+
+// Appends a zeroed command of type with size bytes, rounded up to
+// COMMAND_ALIGN, and returns it, or NULL if the buffer cannot grow. The
+// block only ever holds whole commands, so growing it with realloc() is
+// safe.
+static void *push_command(command_buffer *commands, uint32_t type,
+                          size_t size) {
+  size = (size + COMMAND_ALIGN - 1) & ~(size_t)(COMMAND_ALIGN - 1);
+  if (size > UINT32_MAX) {
+    printf("Command error: %s\n", "command too large");
+    return NULL;
+  }
+  if (commands->size + size > commands->capacity) {
+    size_t capacity = commands->capacity ? commands->capacity * 2 : 4096;
+    while (capacity < commands->size + size)
+      capacity *= 2;
+    uint8_t *data = (uint8_t *)realloc(commands->data, capacity);
+    VARIFYHEAP(data, "push_command()", NULL);
+    commands->data = data;
+    commands->capacity = capacity;
+  }
+
+  command_header *header =
+      (command_header *)(commands->data + commands->size);
+  memset(header, 0, size);
+  header->type = type;
+  header->size = (uint32_t)size;
+  commands->size += size;
+  commands->count++;
+  return header;
+}
+
+// Empties the buffer but keeps its memory for the next frame.
+void reset_command_buffer(command_buffer *commands) {
+  commands->size = 0;
+  commands->count = 0;
+}
+
+void deallocate_command_buffer(command_buffer *commands) {
+  free(commands->data);
+  commands->data = NULL;
+  commands->size = 0;
+  commands->capacity = 0;
+  commands->count = 0;
+}
+
+// The command after command, or the first one when command is NULL. Returns
+// NULL past the last command.
+const command_header *next_command(const command_buffer *commands,
+                                   const command_header *command) {
+  size_t at = command ? (size_t)((const uint8_t *)command - commands->data) +
+                            command->size
+                      : 0;
+  return at < commands->size ? (const command_header *)(commands->data + at)
+                             : NULL;
+}
+
+void record_clear(command_buffer *commands, uint8_t r, uint8_t g, uint8_t b) {
+  clear_command *command = (clear_command *)push_command(
+      commands, COMMAND_CLEAR, sizeof(clear_command));
+  if (!command)
+    return;
+  command->r = r;
+  command->g = g;
+  command->b = b;
+}
+
+// Model draws after this command see the camera as it is now.
+void record_camera(command_buffer *commands, const camera *c) {
+  camera_command *command = (camera_command *)push_command(
+      commands, COMMAND_CAMERA, sizeof(camera_command));
+  if (command)
+    command->camera = *c;
+}
+
+static void record_model_shaded(command_buffer *commands, model *m, int flags,
+                                geometry_shader_fn geometry_shader,
+                                vertex_shader_fn vertex_shader,
+                                uint32_t varying_count,
+                                fragment_shader_fn fragment_shader,
+                                fragment_batch_fn fragment_batch) {
+  model_command *command = (model_command *)push_command(
+      commands, COMMAND_MODEL, sizeof(model_command));
+  if (!command)
+    return;
+  command->model.object = m;
+  command->geometry_shader.function = (command_fn)geometry_shader;
+  command->vertex_shader.function = (command_fn)vertex_shader;
+  command->fragment_shader.function = (command_fn)fragment_shader;
+  command->fragment_batch.function = (command_fn)fragment_batch;
+  command->flags = flags;
+  command->varying_count = varying_count;
+  memcpy(command->position, m->position, sizeof(vec3));
+  memcpy(command->rotation, m->rotation, sizeof(vec3));
+  memcpy(command->scale, m->scale, sizeof(vec3));
+}
+
+// Records a draw of m as render_model() would make it, at m's current
+// transform.
+void record_model(command_buffer *commands, model *m, int flags,
+                  geometry_shader_fn geometry_shader,
+                  fragment_shader_fn fragment_shader) {
+  record_model_shaded(commands, m, flags, geometry_shader, NULL, 0,
+                      fragment_shader, NULL);
+}
+
+// Recorded form of render_model_batched(), see record_model().
+void record_model_batched(command_buffer *commands, model *m, int flags,
+                          geometry_shader_fn geometry_shader,
+                          fragment_batch_fn fragment_batch) {
+  record_model_shaded(commands, m, flags, geometry_shader, NULL, 0, NULL,
+                      fragment_batch);
+}
+
+// Recorded form of render_model_varyings(), see record_model().
+void record_model_varyings(command_buffer *commands, model *m, int flags,
+                           geometry_shader_fn geometry_shader,
+                           vertex_shader_fn vertex_shader,
+                           uint32_t varying_count,
+                           fragment_batch_fn fragment_batch) {
+  record_model_shaded(commands, m, flags, geometry_shader, vertex_shader,
+                      varying_count, NULL, fragment_batch);
+}
+
+// Recorded form of render_model_instanced(). The instances are copied into
+// the buffer.
+void record_model_instanced(command_buffer *commands, model *m, int flags,
+                            geometry_shader_fn geometry_shader,
+                            vertex_shader_fn vertex_shader,
+                            uint32_t varying_count,
+                            fragment_batch_fn fragment_batch,
+                            const model_instance *instances,
+                            uint32_t instance_count) {
+  instanced_command *command = (instanced_command *)push_command(
+      commands, COMMAND_INSTANCED,
+      sizeof(instanced_command) +
+          (size_t)instance_count * sizeof(model_instance));
+  if (!command)
+    return;
+  command->model.object = m;
+  command->geometry_shader.function = (command_fn)geometry_shader;
+  command->vertex_shader.function = (command_fn)vertex_shader;
+  command->fragment_batch.function = (command_fn)fragment_batch;
+  command->flags = flags;
+  command->varying_count = varying_count;
+  command->instance_count = instance_count;
+  if (instance_count)
+    memcpy(command->instances, instances,
+           (size_t)instance_count * sizeof(model_instance));
+}
+
+void record_line(command_buffer *commands, uint8_t r, uint8_t g, uint8_t b,
+                 uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+  line_command *command = (line_command *)push_command(
+      commands, COMMAND_LINE, sizeof(line_command));
+  if (!command)
+    return;
+  command->x1 = x1;
+  command->y1 = y1;
+  command->x2 = x2;
+  command->y2 = y2;
+  command->r = r;
+  command->g = g;
+  command->b = b;
+}
+
+static void swap_transform(model *m, vec3 position, vec3 rotation,
+                           vec3 scale) {
+  for (int i = 0; i < 3; i++) {
+    float p = m->position[i], r = m->rotation[i], s = m->scale[i];
+    m->position[i] = position[i];
+    m->rotation[i] = rotation[i];
+    m->scale[i] = scale[i];
+    position[i] = p;
+    rotation[i] = r;
+    scale[i] = s;
+  }
+}
+
+// Queues the draw with the recorded transform swapped into the model, which
+// the queue reads right away, so the model is left as it was.
+static void execute_model(SDL_display *display, const model_command *command,
+                          camera *c) {
+  model *m = (model *)command->model.object;
+  vec3 position, rotation, scale;
+  memcpy(position, command->position, sizeof(vec3));
+  memcpy(rotation, command->rotation, sizeof(vec3));
+  memcpy(scale, command->scale, sizeof(vec3));
+  swap_transform(m, position, rotation, scale);
+
+  geometry_shader_fn geometry_shader =
+      (geometry_shader_fn)command->geometry_shader.function;
+  if (command->fragment_shader.function)
+    queue_model(display, m, c, command->flags, geometry_shader,
+                (fragment_shader_fn)command->fragment_shader.function);
+  else
+    queue_model_varyings(display, m, c, command->flags, geometry_shader,
+                         (vertex_shader_fn)command->vertex_shader.function,
+                         command->varying_count,
+                         (fragment_batch_fn)command->fragment_batch.function);
+
+  swap_transform(m, position, rotation, scale);
+}
+
+// Runs the commands in order. Model draws go through the display's render
+// queue, so those between two clears are sorted as flush_render_queue()
+// does; lines flush the queue and land on top of everything before them.
+// Draws recorded before the first camera command are skipped.
+void execute_command_buffer(SDL_display *display,
+                            const command_buffer *commands) {
+  camera view = {.fovy = 0.0f};
+  int has_camera = 0;
+
+  for (const command_header *header = next_command(commands, NULL); header;
+       header = next_command(commands, header)) {
+    switch (header->type) {
+    case COMMAND_CLEAR: {
+      const clear_command *command = (const clear_command *)header;
+      clear_display(display, command->r, command->g, command->b);
+      break;
+    }
+    case COMMAND_CAMERA:
+      view = ((const camera_command *)header)->camera;
+      has_camera = 1;
+      break;
+    case COMMAND_MODEL:
+      if (has_camera)
+        execute_model(display, (const model_command *)header, &view);
+      break;
+    case COMMAND_INSTANCED: {
+      const instanced_command *command = (const instanced_command *)header;
+      if (has_camera)
+        render_model_instanced(
+            display, (model *)command->model.object, &view, command->flags,
+            (geometry_shader_fn)command->geometry_shader.function,
+            (vertex_shader_fn)command->vertex_shader.function,
+            command->varying_count,
+            (fragment_batch_fn)command->fragment_batch.function,
+            command->instances, command->instance_count);
+      break;
+    }
+    case COMMAND_LINE: {
+      const line_command *command = (const line_command *)header;
+      set_line(display, command->r, command->g, command->b, command->x1,
+               command->y1, command->x2, command->y2);
+      break;
+    }
+    }
+  }
+}
+
+// What a command_ref points to, which picks its table.
+#define REF_MODEL 0
+#define REF_GEOMETRY_SHADER 1
+#define REF_VERTEX_SHADER 2
+#define REF_FRAGMENT_SHADER 3
+#define REF_FRAGMENT_BATCH 4
+
+static uint32_t table_count(const command_table *table, int kind) {
+  switch (kind) {
+  case REF_MODEL:
+    return table->model_count;
+  case REF_GEOMETRY_SHADER:
+    return table->geometry_shader_count;
+  case REF_VERTEX_SHADER:
+    return table->vertex_shader_count;
+  case REF_FRAGMENT_SHADER:
+    return table->fragment_shader_count;
+  default:
+    return table->fragment_batch_count;
+  }
+}
+
+// Entry i of the table for kind, as stored in a command_ref.
+static command_ref table_entry(const command_table *table, int kind,
+                               uint32_t i) {
+  command_ref ref = {0};
+  switch (kind) {
+  case REF_MODEL:
+    ref.object = table->models[i];
+    break;
+  case REF_GEOMETRY_SHADER:
+    ref.function = (command_fn)table->geometry_shaders[i];
+    break;
+  case REF_VERTEX_SHADER:
+    ref.function = (command_fn)table->vertex_shaders[i];
+    break;
+  case REF_FRAGMENT_SHADER:
+    ref.function = (command_fn)table->fragment_shaders[i];
+    break;
+  default:
+    ref.function = (command_fn)table->fragment_batches[i];
+    break;
+  }
+  return ref;
+}
+
+// Swaps ref between a pointer and its position in the table for kind, plus
+// one so NULL is 0. Fails on a pointer missing from the table or an index
+// past its end.
+static int convert_ref(command_ref *ref, const command_table *table, int kind,
+                       int to_index) {
+  uint32_t count = table_count(table, kind);
+  if (!to_index) {
+    uint64_t index = ref->index;
+    if (index > count)
+      return 0;
+    if (index)
+      *ref = table_entry(table, kind, (uint32_t)(index - 1));
+    else
+      *ref = (command_ref){0};
+    return 1;
+  }
+
+  int model = kind == REF_MODEL;
+  if (model ? !ref->object : !ref->function) {
+    ref->index = 0;
+    return 1;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    command_ref entry = table_entry(table, kind, i);
+    if (model ? entry.object == ref->object
+              : entry.function == ref->function) {
+      ref->index = (uint64_t)i + 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Converts every reference in commands one way or the other. Converting to
+// pointers also checks that the commands fill the buffer exactly, are each
+// large enough for their type and have the model and shaders a draw needs,
+// so a damaged file is refused rather than executed.
+static int convert_command_refs(command_buffer *commands,
+                                const command_table *table, int to_index) {
+  uint32_t count = 0;
+  size_t at = 0;
+  while (at < commands->size) {
+    command_header *header = (command_header *)(commands->data + at);
+    if (commands->size - at < sizeof(command_header) ||
+        header->size % COMMAND_ALIGN != 0 ||
+        header->size > commands->size - at)
+      return 0;
+
+    size_t needed = 0;
+    int ok = 1;
+    switch (header->type) {
+    case COMMAND_CLEAR:
+      needed = sizeof(clear_command);
+      break;
+    case COMMAND_CAMERA:
+      needed = sizeof(camera_command);
+      break;
+    case COMMAND_LINE:
+      needed = sizeof(line_command);
+      break;
+    case COMMAND_MODEL: {
+      needed = sizeof(model_command);
+      if (header->size < needed)
+        return 0;
+      model_command *command = (model_command *)header;
+      ok = convert_ref(&command->model, table, REF_MODEL, to_index) &&
+           convert_ref(&command->geometry_shader, table, REF_GEOMETRY_SHADER,
+                       to_index) &&
+           convert_ref(&command->vertex_shader, table, REF_VERTEX_SHADER,
+                       to_index) &&
+           convert_ref(&command->fragment_shader, table, REF_FRAGMENT_SHADER,
+                       to_index) &&
+           convert_ref(&command->fragment_batch, table, REF_FRAGMENT_BATCH,
+                       to_index);
+      // Loaded draws need what the render_model functions need.
+      if (ok && !to_index)
+        ok = command->model.object && command->geometry_shader.function &&
+             (command->fragment_shader.function ||
+              command->fragment_batch.function);
+      break;
+    }
+    case COMMAND_INSTANCED: {
+      if (header->size < sizeof(instanced_command))
+        return 0;
+      instanced_command *command = (instanced_command *)header;
+      needed = sizeof(instanced_command) +
+               (size_t)command->instance_count * sizeof(model_instance);
+      if (header->size < needed)
+        return 0;
+      ok = convert_ref(&command->model, table, REF_MODEL, to_index) &&
+           convert_ref(&command->geometry_shader, table, REF_GEOMETRY_SHADER,
+                       to_index) &&
+           convert_ref(&command->vertex_shader, table, REF_VERTEX_SHADER,
+                       to_index) &&
+           convert_ref(&command->fragment_batch, table, REF_FRAGMENT_BATCH,
+                       to_index);
+      if (ok && !to_index)
+        ok = command->model.object && command->geometry_shader.function &&
+             command->fragment_batch.function;
+      break;
+    }
+    default:
+      return 0;
+    }
+    if (!ok || header->size < needed)
+      return 0;
+    at += header->size;
+    count++;
+  }
+  commands->count = count;
+  return 1;
+}
+
+// Writes count buffers to path, references given by table, for
+// load_command_buffers(). Fails if a command refers to a model or shader
+// table does not list.
+int save_command_buffers(const command_buffer *buffers, uint32_t count,
+                         const command_table *table, const char *path) {
+  command_file_header h = {0};
+  memcpy(h.magic, COMMAND_FILE_MAGIC, sizeof(h.magic));
+  h.version = COMMAND_FILE_VERSION;
+  h.byte_order = COMMAND_FILE_BYTE_ORDER;
+  h.buffer_count = count;
+  h.model_command_size = sizeof(model_command);
+  h.instance_size = sizeof(model_instance);
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    printf("Command error: cannot write %s\n", path);
+    return 0;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for (uint32_t i = 0; ok && i < count; i++) {
+    // References are converted in a copy so buffers stay executable.
+    command_buffer copy = buffers[i];
+    copy.data = (uint8_t *)malloc(copy.size ? copy.size : 1);
+    if (!copy.data) {
+      printf("Heap allocation error: %s\n", "save_command_buffers()");
+      ok = 0;
+      break;
+    }
+    if (copy.size)
+      memcpy(copy.data, buffers[i].data, copy.size);
+    if (convert_command_refs(&copy, table, 1)) {
+      uint64_t size = copy.size;
+      ok = fwrite(&size, sizeof(size), 1, f) == 1 &&
+           fwrite(copy.data, 1, copy.size, f) == copy.size;
+    } else {
+      printf("Command error: buffer %u refers to something not in the "
+             "table\n",
+             i);
+      ok = 0;
+    }
+    free(copy.data);
+  }
+  if (fclose(f) != 0)
+    ok = 0;
+  if (!ok)
+    printf("Command error: cannot write %s\n", path);
+  return ok;
+}
+
+// Reads the buffers saved to path by save_command_buffers(), resolving
+// references through table, which must list the same models and shaders in
+// the same order. Returns an array of *count buffers, each to be released
+// with deallocate_command_buffer() before the array itself is freed, or
+// NULL on failure.
+command_buffer *load_command_buffers(const char *path,
+                                     const command_table *table,
+                                     uint32_t *count) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    printf("Command error: cannot open %s\n", path);
+    return NULL;
+  }
+  // Sizes read from the file are checked against what is left of it before
+  // anything is allocated for them.
+  fseek(f, 0, SEEK_END);
+  long file_size = ftell(f);
+  rewind(f);
+  uint64_t remaining = file_size > 0 ? (uint64_t)file_size : 0;
+
+  command_file_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || remaining < sizeof(h) ||
+      memcmp(h.magic, COMMAND_FILE_MAGIC, sizeof(h.magic)) != 0 ||
+      h.version != COMMAND_FILE_VERSION ||
+      h.byte_order != COMMAND_FILE_BYTE_ORDER ||
+      h.model_command_size != sizeof(model_command) ||
+      h.instance_size != sizeof(model_instance) || h.buffer_count == 0 ||
+      h.buffer_count > (remaining - sizeof(h)) / sizeof(uint64_t)) {
+    printf("Command error: %s is not a command file for this build\n", path);
+    fclose(f);
+    return NULL;
+  }
+
+  command_buffer *buffers =
+      (command_buffer *)calloc(h.buffer_count, sizeof(command_buffer));
+  if (!buffers) {
+    printf("Heap allocation error: %s\n", "load_command_buffers()");
+    fclose(f);
+    return NULL;
+  }
+
+  remaining -= sizeof(h);
+  int ok = 1;
+  for (uint32_t i = 0; ok && i < h.buffer_count; i++) {
+    uint64_t size;
+    ok = fread(&size, sizeof(size), 1, f) == 1 &&
+         size <= remaining - sizeof(size);
+    remaining -= ok ? sizeof(size) + size : 0;
+    if (ok && size) {
+      buffers[i].data = (uint8_t *)malloc((size_t)size);
+      ok = buffers[i].data && fread(buffers[i].data, (size_t)size, 1, f) == 1;
+      if (ok)
+        buffers[i].size = buffers[i].capacity = (size_t)size;
+    }
+    ok = ok && convert_command_refs(&buffers[i], table, 0);
+  }
+  fclose(f);
+
+  if (!ok) {
+    printf("Command error: %s is damaged or does not match the table\n",
+           path);
+    for (uint32_t i = 0; i < h.buffer_count; i++)
+      deallocate_command_buffer(&buffers[i]);
+    free(buffers);
+    return NULL;
+  }
+  *count = h.buffer_count;
+  return buffers;
+}
@@ -1,6 +1,5 @@
 #include "display.h"
 
-#define PIXEL_I(x, y) ((y) * DEFAULT_BUFFER_WIDTH + (x))
 #define CLAMP(v, lo, hi) ((v) < (lo) ? (lo) : ((v) > (hi) ? (hi) : (v)))
 
 #define VARIFYHEAP(pointer, str, type)                                         \
@@ -9,6 +8,79 @@
     return type;                                                               \
   }
 
+// malloc() only promises alignment for the largest scalar type. The original
+// pointer is kept just below the aligned block for deallocate_aligned().
+static void *allocate_aligned(size_t len) {
+  uint8_t *raw =
+      (uint8_t *)malloc(len + DISPLAY_BUFFER_ALIGN + sizeof(void *));
+  if (!raw)
+    return NULL;
+  uintptr_t addr = (uintptr_t)raw + sizeof(void *) + DISPLAY_BUFFER_ALIGN - 1;
+  addr &= ~(uintptr_t)(DISPLAY_BUFFER_ALIGN - 1);
+  ((void **)addr)[-1] = raw;
+  return (void *)addr;
+}
+
+static void deallocate_aligned(void *ptr) {
+  if (ptr)
+    free(((void **)ptr)[-1]);
+}
+
+static void deallocate_render_queue(render_queue *queue);
+
+static void deallocate_backbuffer(SDL_display *display) {
+  SDL_FreeSurface(display->surface);
+  deallocate_aligned(display->pixels);
+  deallocate_aligned(display->zbuffer);
+  if (display->hiz)
+    deallocate_hiz_buffer(display->hiz);
+  display->surface = NULL;
+  display->pixels = NULL;
+  display->zbuffer = NULL;
+  display->hiz = NULL;
+}
+
+// Allocates colour and depth buffers for buffer_width x buffer_height. Rows
+// are padded to a whole number of cache lines, and the surface is a view onto
+// the aligned colour buffer.
+static int allocate_backbuffer(SDL_display *display) {
+  select_raster_kernel(RASTER_KERNEL_AUTO);
+
+  uint16_t width = display->buffer_width, height = display->buffer_height;
+  if (width == 0 || height == 0 || width > RASTER_MAX_DIM ||
+      height > RASTER_MAX_DIM) {
+    SDL_Log("Backbuffer %ux%u is outside 1x1 to %ux%u", width, height,
+            RASTER_MAX_DIM, RASTER_MAX_DIM);
+    return 0;
+  }
+
+  int pitch = (width * 4 + DISPLAY_BUFFER_ALIGN - 1) &
+              ~(DISPLAY_BUFFER_ALIGN - 1);
+  size_t len = (size_t)pitch * height;
+  size_t depth_len =
+      (size_t)(pitch / 4) * height * depth_format_bytes(display->depth_format);
+  display->pixels = (uint32_t *)allocate_aligned(len);
+  display->zbuffer = allocate_aligned(depth_len);
+  display->hiz = allocate_hiz_buffer(width, height);
+  if (!display->pixels || !display->zbuffer || !display->hiz) {
+    printf("Heap allocation error: %s\n", "allocate_backbuffer()");
+    deallocate_backbuffer(display);
+    return 0;
+  }
+
+  display->surface = SDL_CreateRGBSurfaceWithFormatFrom(
+      display->pixels, width, height, 32, pitch, DISPLAY_PIXEL_FORMAT);
+  if (!display->surface) {
+    SDL_Log("SDL Surface Failure: %s", SDL_GetError());
+    deallocate_backbuffer(display);
+    return 0;
+  }
+
+  memset(display->pixels, 0, len);
+  memset(display->zbuffer, 0xFF, depth_len);
+  return 1;
+}
+
 SDL_display *allocate_display(uint16_t width, uint16_t height,
                               const char *title) {
   if (SDL_Init(SDL_INIT_VIDEO) != 0)
@@ -29,24 +101,46 @@ SDL_display *allocate_display(uint16_t width, uint16_t height,
       display->title, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
       display->window_width, display->window_height, SDL_WINDOW_SHOWN);
 
-  memset(&display->zbuffer, 0, sizeof(display->zbuffer));
-
   if (!display->pointer) {
     SDL_Log("SDL Window Failure: %s", SDL_GetError());
+    free(display);
+    SDL_Quit();
+    return NULL;
+  }
+
+  if (!allocate_backbuffer(display)) {
+    SDL_DestroyWindow(display->pointer);
+    free(display);
     SDL_Quit();
     return NULL;
   }
 
-  display->surface = SDL_CreateRGBSurface(
-      0, display->buffer_width, display->buffer_height, 32, 0, 0, 0, 0);
   SDL_Surface *frontbuffer = SDL_GetWindowSurface(display->pointer);
   SDL_Rect dst_rect = {0, 0, frontbuffer->w, frontbuffer->h};
   SDL_BlitScaled(display->surface, NULL, frontbuffer, &dst_rect);
 
   SDL_UpdateWindowSurface(display->pointer);
 
-  for (uint32_t i = 0; i < DEFAULT_BUF_LEN; i++) {
-    display->zbuffer.value[i] = 0xFFFFFFFF;
+  return display;
+}
+
+// Same backbuffer/zbuffer layout as allocate_display() for the given window
+// size, but no window is created and cycle_display() never presents. Pixels
+// are read back with get_display_pixels() or read_display_pixels().
+SDL_display *allocate_display_headless(uint16_t width, uint16_t height) {
+  SDL_display *display = (SDL_display *)calloc(1, sizeof(SDL_display));
+  VARIFYHEAP(display, "allocate_display_headless()", NULL)
+
+  display->headless = 1;
+  display->window_width = width;
+  display->window_height = height;
+  display->buffer_width = width / DEFAULT_BUFFER_SCALE_FACTOR;
+  display->buffer_height = height / DEFAULT_BUFFER_SCALE_FACTOR;
+  display->title = NULL;
+
+  if (!allocate_backbuffer(display)) {
+    free(display);
+    return NULL;
   }
 
   return display;
@@ -54,26 +148,142 @@ SDL_display *allocate_display(uint16_t width, uint16_t height,
 
 void deallocate_display(SDL_display *display) {
   VARIFYHEAP(display, "deallocate_display", )
-  SDL_DestroyWindow(display->pointer);
-  SDL_Quit();
+  deallocate_render_queue(display->queue);
+  if (display->binner)
+    deallocate_tile_binner(display->binner);
+  deallocate_backbuffer(display);
+  if (!display->headless) {
+    SDL_DestroyWindow(display->pointer);
+    SDL_Quit();
+  }
   free(display);
 }
 
 void cycle_display(SDL_display *display) {
+  flush_display(display);
+
   if (SDL_MUSTLOCK(display->surface))
     SDL_UnlockSurface(display->surface);
 
+  if (display->headless)
+    return;
+
   SDL_Surface *frontbuffer = SDL_GetWindowSurface(display->pointer);
   SDL_Rect dst_rect = {0, 0, frontbuffer->w, frontbuffer->h};
   SDL_BlitScaled(display->surface, NULL, frontbuffer, &dst_rect);
   SDL_UpdateWindowSurface(display->pointer);
 }
 
+// Builds the buffers described by changed, then swaps them in for display's
+// own. On failure display is left untouched and 0 is returned.
+static int reallocate_backbuffer(SDL_display *display,
+                                 const SDL_display *changed) {
+  flush_display(display);
+  SDL_display replaced = *changed;
+  if (!allocate_backbuffer(&replaced))
+    return 0;
+
+  if (display->binner)
+    deallocate_tile_binner(display->binner);
+  deallocate_backbuffer(display);
+  *display = replaced;
+  display->binner = NULL;
+  set_display_thread_count(display, display->thread_count);
+  return 1;
+}
+
+// Reallocates colour and depth buffers at a new resolution; the window keeps
+// its size and the backbuffer is scaled to it on present. On failure the old
+// buffers are kept and 0 is returned.
+int resize_display(SDL_display *display, uint16_t buffer_width,
+                   uint16_t buffer_height) {
+  if (buffer_width == display->buffer_width &&
+      buffer_height == display->buffer_height)
+    return 1;
+
+  SDL_display resized = *display;
+  resized.buffer_width = buffer_width;
+  resized.buffer_height = buffer_height;
+  return reallocate_backbuffer(display, &resized);
+}
+
+// Switches the zbuffer to one of the DEPTH_* formats. The projection follows
+// the format, so the next frame must clear before drawing; the colour buffer
+// is reallocated along with depth and starts out black. Any other value is
+// refused and 0 is returned.
+int set_display_depth_format(SDL_display *display, int depth_format) {
+  if (depth_format < 0 || depth_format >= DEPTH_FORMAT_COUNT) {
+    SDL_Log("Depth format %d is outside 0 to %d", depth_format,
+            DEPTH_FORMAT_COUNT - 1);
+    return 0;
+  }
+  if (depth_format == display->depth_format)
+    return 1;
+
+  SDL_display changed = *display;
+  changed.depth_format = depth_format;
+  return reallocate_backbuffer(display, &changed);
+}
+
+// 0 rasterizes each triangle as soon as it is set up. Any other count bins
+// triangles into screen tiles and rasterizes them on that many threads (the
+// caller's included) when the display is flushed; DISPLAY_THREADS_AUTO uses
+// one per CPU.
+void set_display_thread_count(SDL_display *display, int thread_count) {
+  if (display->binner) {
+    resolve_tile_binner_depth(display->binner);
+    deallocate_tile_binner(display->binner);
+    display->binner = NULL;
+  }
+
+  display->thread_count = thread_count;
+  if (thread_count < 0)
+    thread_count = SDL_GetCPUCount();
+  if (thread_count == 0)
+    return;
+
+  display->binner = allocate_tile_binner(display->surface, display->zbuffer,
+                                         display->depth_format, display->hiz,
+                                         (uint16_t)thread_count);
+}
+
+void set_display_clear_mode(SDL_display *display, int clear_mode) {
+  display->clear_mode = clear_mode;
+}
+
+void flush_display(SDL_display *display) {
+  flush_render_queue(display);
+  if (display->binner)
+    flush_tile_binner(display->binner);
+}
+
+const uint32_t *get_display_pixels(SDL_display *display, uint16_t *pitch) {
+  flush_display(display);
+  if (pitch)
+    *pitch = display->surface->pitch / 4;
+  return (const uint32_t *)display->surface->pixels;
+}
+
+void read_display_pixels(SDL_display *display, uint8_t *rgb) {
+  flush_display(display);
+  const uint32_t *pixels = (const uint32_t *)display->surface->pixels;
+  uint16_t pitch = display->surface->pitch / 4;
+
+  for (uint16_t y = 0; y < display->buffer_height; y++)
+    for (uint16_t x = 0; x < display->buffer_width; x++) {
+      uint8_t *out = &rgb[(y * display->buffer_width + x) * 3];
+      SDL_GetRGB(pixels[y * pitch + x], display->surface->format, &out[0],
+                 &out[1], &out[2]);
+    }
+}
+
 void set_pixel(SDL_display *display, uint16_t x, uint16_t y, uint8_t r,
                uint8_t g, uint8_t b) {
   if (x < 0 || x >= display->surface->w || y < 0 || y >= display->surface->h)
     return;
-  uint32_t value = SDL_MapRGB(display->surface->format, r, g, b);
+  flush_display(display);
+  uint32_t value =
+      pack_pixel(get_pixel_packing(display->surface), r, g, b);
   uint32_t *pixels = (uint32_t *)display->surface->pixels;
 
   pixels[y * display->surface->pitch / 4 + x] = value;
@@ -81,16 +291,19 @@ void set_pixel(SDL_display *display, uint16_t x, uint16_t y, uint8_t r,
 
 void set_line(SDL_display *display, uint8_t r, uint8_t g, uint8_t b,
               uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2) {
+  flush_display(display);
   draw_line_to_backbuffer(display->surface, r, g, b, x1, y1, x2, y2);
 }
 
 void set_wframe_tri(SDL_display *display, uint8_t r, uint8_t g, uint8_t b,
                     vec2i v1, vec2i v2, vec2i v3, int debug) {
+  flush_display(display);
   draw_wireframe_tri_to_backbuffer(display->surface, v1, v2, v3, r, g, b,
                                    debug);
 }
 void set_tri(SDL_display *display, uint8_t r, uint8_t g, uint8_t b, vec2i v1,
              vec2i v2, vec2i v3, int debug) {
+  flush_display(display);
   draw_tri_to_backbuffer(display->surface, v1, v2, v3, r, g, b, debug);
 }
 
@@ -102,9 +315,12 @@ void set_tri3d(SDL_display *display, camera c, uint8_t r, uint8_t g, uint8_t b,
                                        uint8_t g, uint8_t b),
                void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv,
                                        vec3 position, vec3 normal)) {
-  draw_tri3d_to_backbuffer_zbuffered(display->surface, display->zbuffer.value,
-                                     c, v1, v2, v3, r, g, b, pos, rot, pivot,
-                                     debug, geometry_shader, fragment_shader);
+  flush_render_queue(display);
+  if (display->binner)
+    resolve_tile_binner_depth(display->binner);
+  draw_tri3d_to_backbuffer_zbuffered(
+      display->surface, display->zbuffer, display->depth_format, c, v1, v2, v3,
+      r, g, b, pos, rot, pivot, debug, geometry_shader, fragment_shader);
 }
 
 void set_tri3d_no_zbuffer(
@@ -114,18 +330,31 @@ void set_tri3d_no_zbuffer(
                             vec3 light_dir, uint8_t r, uint8_t g, uint8_t b),
     void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
                             vec3 normal)) {
+  flush_display(display);
   draw_tri3d_to_backbuffer(display->surface, c, v1, v2, v3, r, g, b, pos, rot,
                            pivot, debug, geometry_shader, fragment_shader);
 }
 
 void clear_display(SDL_display *display, uint8_t r, uint8_t g, uint8_t b) {
-  uint32_t color = SDL_MapRGB(display->surface->format, r, g, b);
+  flush_render_queue(display);
+  uint32_t color = pack_pixel(get_pixel_packing(display->surface), r, g, b);
   if (SDL_MUSTLOCK(display->surface))
     SDL_LockSurface(display->surface);
-  SDL_FillRect(display->surface, NULL, color);
-  for (uint32_t i = 0; i < DEFAULT_BUF_LEN; i++) {
-    display->zbuffer.value[i] = 0xFFFFFFFF;
+
+  if (display->binner && display->clear_mode == DISPLAY_CLEAR_DEFERRED) {
+    clear_tile_binner(display->binner, color);
+    return;
   }
+
+  flush_display(display);
+  size_t len = (size_t)(display->surface->pitch / 4) * display->surface->h;
+  fill_u32(display->pixels, color, len);
+  // Every format's far value is all ones, so 16-bit depth clears as half as
+  // many 32-bit words.
+  fill_u32((uint32_t *)display->zbuffer, 0xFFFFFFFF,
+           len * depth_format_bytes(display->depth_format) / 4);
+  bbox2i all = {{0, 0}, {display->surface->w - 1, display->surface->h - 1}};
+  clear_hiz_buffer(display->hiz, all);
 }
 
 static void init_tris_CUBE(tri *out) {
@@ -259,8 +488,8 @@ static void init_tris_ICO_SPHERE(tri *out) {
 }
 
 static void init_tris_TERRAIN(tri *out) {
-  int xsize = 20;
-  int zsize = 20;
+  int xsize = TERRAIN_SIZE;
+  int zsize = TERRAIN_SIZE;
   float scale = 1.5f;
 
   for (int x = 0; x < xsize - 1; x++) {
@@ -294,44 +523,212 @@ static void init_tris_TERRAIN(tri *out) {
   }
 }
 
-void init_model(model *model, tri *tris, vec3 position, vec3 rotation,
-                vec3 scale, int SHAPE) {
-  if (tris == NULL) {
-    tri temp_tris[MAX_TRI_COUNT];
-    for (int i = 0; i < MAX_TRI_COUNT; i++) {
-      temp_tris[i].v1[0] = temp_tris[i].v1[1] = temp_tris[i].v1[2] = 0.0f;
-      temp_tris[i].v2[0] = temp_tris[i].v2[1] = temp_tris[i].v2[2] = 0.0f;
-      temp_tris[i].v3[0] = temp_tris[i].v3[1] = temp_tris[i].v3[2] = 0.0f;
+static uint32_t shape_tri_count(int SHAPE) {
+  switch (SHAPE) {
+  case SHAPE_CUBE:
+    return 12;
+  case SHAPE_PYRAMID:
+    return 6;
+  case SHAPE_ICO_SPHERE:
+    return 20;
+  case SHAPE_TERRAIN:
+    return (TERRAIN_SIZE - 1) * (TERRAIN_SIZE - 1) * 2;
+  default:
+    return 0;
+  }
+}
+
+static uint32_t hash_vertex(const vec3 v) {
+  uint32_t bits[3];
+  memcpy(bits, v, sizeof(bits));
+  uint32_t h = 2166136261u;
+  for (int i = 0; i < 3; i++) {
+    h ^= bits[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Welds bit-identical corners of the triangle soup into a shared vertex
+// array, preserving first-seen order, and emits one index per corner.
+static void build_indexed_mesh(model *model, tri *tris, uint32_t tri_count) {
+  if (tri_count == 0)
+    return;
+  if (tri_count > MAX_MODEL_TRIS) {
+    printf("Mesh error: %u triangles is more than %u\n", tri_count,
+           MAX_MODEL_TRIS);
+    return;
+  }
+
+  uint32_t corner_count = tri_count * 3;
+  uint32_t table_size = 1;
+  while ((uint64_t)table_size < (uint64_t)corner_count * 2)
+    table_size <<= 1;
+
+  uint32_t *table = (uint32_t *)malloc(table_size * sizeof(uint32_t));
+  vec3 *vertices = (vec3 *)malloc(corner_count * sizeof(vec3));
+  uint32_t *indices = (uint32_t *)malloc(corner_count * sizeof(uint32_t));
+  if (!table || !vertices || !indices) {
+    free(table);
+    free(vertices);
+    free(indices);
+    printf("Heap allocation error: %s\n", "build_indexed_mesh()");
+    return;
+  }
+  memset(table, 0xFF, table_size * sizeof(uint32_t));
+
+  uint32_t vertex_count = 0;
+  for (uint32_t i = 0; i < corner_count; i++) {
+    tri *t = &tris[i / 3];
+    float *v = i % 3 == 0 ? t->v1 : (i % 3 == 1 ? t->v2 : t->v3);
+
+    uint32_t slot = hash_vertex(v) & (table_size - 1);
+    while (table[slot] != 0xFFFFFFFF &&
+           memcmp(vertices[table[slot]], v, sizeof(vec3)) != 0)
+      slot = (slot + 1) & (table_size - 1);
+
+    if (table[slot] == 0xFFFFFFFF) {
+      memcpy(vertices[vertex_count], v, sizeof(vec3));
+      table[slot] = vertex_count++;
+    }
+    indices[i] = table[slot];
+  }
+  free(table);
+
+  model->vertices = (vec3 *)realloc(vertices, vertex_count * sizeof(vec3));
+  if (!model->vertices)
+    model->vertices = vertices;
+  model->vertex_count = vertex_count;
+  model->indices = indices;
+  model->tri_count = tri_count;
+}
+
+// Vertex normals average the normals of the faces around each vertex.
+static void init_vertex_normals(model *model) {
+  for (uint32_t i = 0; i < model->tri_count; i++)
+    for (int j = 0; j < 3; j++) {
+      float *n = model->normals[model->indices[i * 3 + j]];
+      n[0] += model->face_normals[i][0];
+      n[1] += model->face_normals[i][1];
+      n[2] += model->face_normals[i][2];
+    }
+
+  for (uint32_t i = 0; i < model->vertex_count; i++) {
+    float *n = model->normals[i];
+    float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (len > 1e-6f) {
+      n[0] /= len;
+      n[1] /= len;
+      n[2] /= len;
     }
+  }
+}
+
+// Texture coordinates project the vertices straight down onto the x/z
+// extent of the bounds.
+static void init_vertex_uvs(model *model) {
+  const bounds3 *b = &model->bounds;
+  float size_x = b->max[0] - b->min[0];
+  float size_z = b->max[2] - b->min[2];
+  for (uint32_t i = 0; i < model->vertex_count; i++) {
+    const float *v = model->vertices[i];
+    model->uvs[i][0] = size_x > 0.0f ? (v[0] - b->min[0]) / size_x : 0.0f;
+    model->uvs[i][1] = size_z > 0.0f ? (v[2] - b->min[2]) / size_z : 0.0f;
+  }
+}
+
+// Allocates the per-vertex scratch a model is rendered through. Returns 0,
+// with the model deallocated, on failure.
+int allocate_model_caches(model *model) {
+  if (model->vertex_count == 0)
+    return 1;
+  model->clip_cache = (vec4 *)malloc(model->vertex_count * sizeof(vec4));
+  model->varying_cache = (float *)malloc(model->vertex_count *
+                                         MAX_VARYINGS * sizeof(float));
+  if (!model->clip_cache || !model->varying_cache) {
+    printf("Heap allocation error: %s\n", "allocate_model_caches()");
+    deallocate_model(model);
+    return 0;
+  }
+  return 1;
+}
+
+// Completes a model whose vertices and indices are set: computes bounds and
+// face normals, derives vertex normals and texture coordinates unless the
+// mesh supplied them in normals/uvs, and allocates the caches. Returns 0,
+// with the model deallocated, on failure.
+int init_model_attributes(model *model) {
+  compute_bounds3(&model->bounds, model->vertices, model->vertex_count);
+
+  if (model->tri_count > 0) {
+    model->face_normals = (vec3 *)malloc(model->tri_count * sizeof(vec3));
+    if (!model->face_normals) {
+      printf("Heap allocation error: %s\n", "init_model_attributes()");
+      deallocate_model(model);
+      return 0;
+    }
+  }
+  for (uint32_t i = 0; i < model->tri_count; i++)
+    compute_face_normal(model->face_normals[i],
+                        model->vertices[model->indices[i * 3 + 0]],
+                        model->vertices[model->indices[i * 3 + 1]],
+                        model->vertices[model->indices[i * 3 + 2]]);
+
+  if (model->vertex_count > 0) {
+    int derive_normals = !model->normals, derive_uvs = !model->uvs;
+    if (derive_normals)
+      model->normals = (vec3 *)calloc(model->vertex_count, sizeof(vec3));
+    if (derive_uvs)
+      model->uvs = (vec2 *)malloc(model->vertex_count * sizeof(vec2));
+    if (!model->normals || !model->uvs) {
+      printf("Heap allocation error: %s\n", "init_model_attributes()");
+      deallocate_model(model);
+      return 0;
+    }
+    if (derive_normals)
+      init_vertex_normals(model);
+    if (derive_uvs)
+      init_vertex_uvs(model);
+  }
+  return allocate_model_caches(model);
+}
+
+void init_model(model *model, tri *tris, uint32_t tri_count, vec3 position,
+                vec3 rotation, vec3 scale, int SHAPE) {
+  if (tris == NULL)
+    tri_count = shape_tri_count(SHAPE);
+
+  memset(model, 0, sizeof(*model));
+
+  tri *mesh_tris = NULL;
+  if (tri_count > 0) {
+    mesh_tris = (tri *)malloc(tri_count * sizeof(tri));
+    VARIFYHEAP(mesh_tris, "init_model()", )
+  }
 
+  if (tris == NULL) {
     switch (SHAPE) {
     case SHAPE_CUBE:
-      init_tris_CUBE(temp_tris);
+      init_tris_CUBE(mesh_tris);
       break;
 
     case SHAPE_PYRAMID:
-      init_tris_PYRAMID(temp_tris);
+      init_tris_PYRAMID(mesh_tris);
       break;
 
     case SHAPE_ICO_SPHERE:
-      init_tris_ICO_SPHERE(temp_tris);
+      init_tris_ICO_SPHERE(mesh_tris);
       break;
 
     case SHAPE_TERRAIN:
-      init_tris_TERRAIN(temp_tris);
+      init_tris_TERRAIN(mesh_tris);
       break;
 
     default:
       break;
     }
-
-    for (int i = 0; i < MAX_TRI_COUNT; i++) {
-      model->tris[i] = temp_tris[i];
-    }
-  } else {
-    for (int i = 0; i < MAX_TRI_COUNT; i++) {
-      model->tris[i] = tris[i];
-    }
+  } else if (tri_count > 0) {
+    memcpy(mesh_tris, tris, tri_count * sizeof(tri));
   }
   model->position[0] = position[0];
   model->position[1] = position[1];
@@ -343,31 +740,16 @@ void init_model(model *model, tri *tris, vec3 position, vec3 rotation,
   model->scale[1] = scale[1];
   model->scale[2] = scale[2];
 
-  for (int i = 0; i < MAX_TRI_COUNT; i++) {
-    model->tris[i].v1[0] *= model->scale[0];
-    model->tris[i].v1[1] *= model->scale[1];
-    model->tris[i].v1[2] *= model->scale[2];
-    model->tris[i].v2[0] *= model->scale[0];
-    model->tris[i].v2[1] *= model->scale[1];
-    model->tris[i].v2[2] *= model->scale[2];
-    model->tris[i].v3[0] *= model->scale[0];
-    model->tris[i].v3[1] *= model->scale[1];
-    model->tris[i].v3[2] *= model->scale[2];
-  }
-  for (int i = 0; i < MAX_TRI_COUNT; ++i) {
-    float x1 = model->tris[i].v1[0];
-    float y1 = model->tris[i].v1[1];
-    float z1 = model->tris[i].v1[2];
-    float x2 = model->tris[i].v2[0];
-    float y2 = model->tris[i].v2[1];
-    float z2 = model->tris[i].v2[2];
-    float x3 = model->tris[i].v3[0];
-    float y3 = model->tris[i].v3[1];
-    float z3 = model->tris[i].v3[2];
-
-    if (x1 == 0.0f && y1 == 0.0f && z1 == 0.0f && x2 == 0.0f && y2 == 0.0f &&
-        z2 == 0.0f && x3 == 0.0f && y3 == 0.0f && z3 == 0.0f)
-      continue;
+  for (uint32_t i = 0; i < tri_count; ++i) {
+    float x1 = mesh_tris[i].v1[0];
+    float y1 = mesh_tris[i].v1[1];
+    float z1 = mesh_tris[i].v1[2];
+    float x2 = mesh_tris[i].v2[0];
+    float y2 = mesh_tris[i].v2[1];
+    float z2 = mesh_tris[i].v2[2];
+    float x3 = mesh_tris[i].v3[0];
+    float y3 = mesh_tris[i].v3[1];
+    float z3 = mesh_tris[i].v3[2];
 
     float ex1 = x2 - x1;
     float ey1 = y2 - y1;
@@ -386,35 +768,415 @@ void init_model(model *model, tri *tris, vec3 position, vec3 rotation,
 
     float dot = nx * cx + ny * cy + nz * cz;
     if (dot > 0.0f) {
-      float tx = model->tris[i].v2[0];
-      float ty = model->tris[i].v2[1];
-      float tz = model->tris[i].v2[2];
-      model->tris[i].v2[0] = model->tris[i].v3[0];
-      model->tris[i].v2[1] = model->tris[i].v3[1];
-      model->tris[i].v2[2] = model->tris[i].v3[2];
-      model->tris[i].v3[0] = tx;
-      model->tris[i].v3[1] = ty;
-      model->tris[i].v3[2] = tz;
+      float tx = mesh_tris[i].v2[0];
+      float ty = mesh_tris[i].v2[1];
+      float tz = mesh_tris[i].v2[2];
+      mesh_tris[i].v2[0] = mesh_tris[i].v3[0];
+      mesh_tris[i].v2[1] = mesh_tris[i].v3[1];
+      mesh_tris[i].v2[2] = mesh_tris[i].v3[2];
+      mesh_tris[i].v3[0] = tx;
+      mesh_tris[i].v3[1] = ty;
+      mesh_tris[i].v3[2] = tz;
+    }
+  }
+
+  build_indexed_mesh(model, mesh_tris, tri_count);
+  free(mesh_tris);
+  init_model_attributes(model);
+}
+
+void deallocate_model(model *model) {
+  if (model->mapping) {
+    unmap_mesh_file(model->mapping);
+  } else {
+    free(model->vertices);
+    free(model->indices);
+    free(model->face_normals);
+    free(model->normals);
+    free(model->uvs);
+  }
+  free(model->clip_cache);
+  free(model->varying_cache);
+  model->mapping = NULL;
+  model->vertices = NULL;
+  model->indices = NULL;
+  model->clip_cache = NULL;
+  model->face_normals = NULL;
+  model->normals = NULL;
+  model->uvs = NULL;
+  model->varying_cache = NULL;
+  model->vertex_count = 0;
+  model->tri_count = 0;
+}
+
+// Pipeline state shared by every draw of one mesh with one set of shaders.
+typedef struct {
+  raster_target target;
+  int flags;
+  geometry_shader_fn geometry_shader;
+  vertex_shader_fn vertex_shader;
+  fragment_shader_fn fragment_shader;
+  fragment_batch_fn fragment_batch;
+} model_pipeline;
+
+static void setup_model_pipeline(model_pipeline *p, SDL_display *display,
+                                 const model *m, int flags,
+                                 geometry_shader_fn geometry_shader,
+                                 vertex_shader_fn vertex_shader,
+                                 uint32_t varying_count,
+                                 fragment_shader_fn fragment_shader,
+                                 fragment_batch_fn fragment_batch) {
+  raster_target target = {.surface = display->surface,
+                           .zbuffer = display->zbuffer,
+                           .depth_format = display->depth_format,
+                           .binner = display->binner,
+                           .hiz = display->hiz,
+                           .texture = m->texture};
+  // A batched shader with a registered variant gets a pixel loop with it
+  // inlined; the lookup is made once here rather than per triangle.
+  if (fragment_batch)
+    target.kernel =
+        find_raster_variant(fragment_batch, display->depth_format,
+                            (flags & RENDER_LATE_DEPTH) != 0);
+  if (vertex_shader)
+    target.varying_count =
+        varying_count < MAX_VARYINGS ? varying_count : MAX_VARYINGS;
+
+  p->target = target;
+  p->flags = flags;
+  p->geometry_shader = geometry_shader;
+  p->vertex_shader = vertex_shader;
+  p->fragment_shader = fragment_shader;
+  p->fragment_batch = fragment_batch;
+}
+
+// Draws m's mesh once with transform t, tinting its triangles r, g, b.
+static void render_mesh(const model_pipeline *p, model *m,
+                        const draw_transform *t, uint8_t r, uint8_t g,
+                        uint8_t b) {
+  if (cull_bounds3(t, &m->bounds)) {
+    add_render_stats(&(render_stats){.models_culled = 1});
+    return;
+  }
+
+  transform_vertices(t, m->vertices, m->clip_cache, m->vertex_count);
+  if (p->vertex_shader)
+    for (uint32_t i = 0; i < m->vertex_count; i++)
+      p->vertex_shader(m->varying_cache + i * MAX_VARYINGS, m->vertices[i],
+                       m->normals[i], m->uvs[i], t);
+
+  render_stats culled = {0};
+  for (uint32_t i = 0; i < m->tri_count; i++) {
+    uint32_t i1 = m->indices[i * 3 + 0];
+    uint32_t i2 = m->indices[i * 3 + 1];
+    uint32_t i3 = m->indices[i * 3 + 2];
+    if (is_backface(m->face_normals[i], m->vertices[i1], t->eye)) {
+      culled.triangles_culled++;
+      continue;
     }
+    const float *varyings[3] = {m->varying_cache + i1 * MAX_VARYINGS,
+                                m->varying_cache + i2 * MAX_VARYINGS,
+                                m->varying_cache + i3 * MAX_VARYINGS};
+    draw_clip_tri_to_backbuffer_zbuffered(
+        &p->target, t, m->clip_cache[i1], m->clip_cache[i2],
+        m->clip_cache[i3], m->face_normals[i],
+        p->vertex_shader ? varyings : NULL, r, g, b, p->flags,
+        p->geometry_shader, p->fragment_shader, p->fragment_batch);
   }
+  add_render_stats(&culled);
+}
+
+static void render_model_shaded(SDL_display *display, model *m, camera *c,
+                                int flags, geometry_shader_fn geometry_shader,
+                                vertex_shader_fn vertex_shader,
+                                uint32_t varying_count,
+                                fragment_shader_fn fragment_shader,
+                                fragment_batch_fn fragment_batch) {
+  // Queued draws were made first, so they are drawn first.
+  flush_render_queue(display);
+  model_pipeline p;
+  setup_model_pipeline(&p, display, m, flags, geometry_shader, vertex_shader,
+                       varying_count, fragment_shader, fragment_batch);
+  draw_transform t;
+  setup_draw_transform(&t, c, m->position, m->rotation, m->scale,
+                       (vec3){0.0f, 0.0f, 0.0f}, display->surface->w,
+                       display->surface->h, display->depth_format);
+  render_mesh(&p, m, &t, 255, 255, 255);
 }
 
-void render_model(SDL_display *display, model *m, camera *c, int wframe,
+void render_model(SDL_display *display, model *m, camera *c, int flags,
                   void (*geometry_shader)(vec4 OUT, vec3 normal, vec2 uv,
                                           vec3 position, vec3 light_dir,
                                           uint8_t r, uint8_t g, uint8_t b),
                   void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv,
                                           vec3 position, vec3 normal)) {
-  for (int i = 0; i < MAX_TRI_COUNT; i++) {
-    if (m->tris[i].v1[0] == 0.0f && m->tris[i].v1[1] == 0.0f &&
-        m->tris[i].v1[2] == 0.0f && m->tris[i].v2[0] == 0.0f &&
-        m->tris[i].v2[1] == 0.0f && m->tris[i].v2[2] == 0.0f &&
-        m->tris[i].v3[0] == 0.0f && m->tris[i].v3[1] == 0.0f &&
-        m->tris[i].v3[2] == 0.0) {
-      continue;
+  render_model_shaded(display, m, c, flags, geometry_shader, NULL, 0,
+                      fragment_shader, NULL);
+}
+
+// Same as render_model() with a batched fragment shader, see fragment_batch.
+void render_model_batched(SDL_display *display, model *m, camera *c, int flags,
+                          geometry_shader_fn geometry_shader,
+                          fragment_batch_fn fragment_batch) {
+  render_model_shaded(display, m, c, flags, geometry_shader, NULL, 0, NULL,
+                      fragment_batch);
+}
+
+// Same as render_model_batched() with a vertex stage: vertex_shader writes
+// varying_count floats for each vertex, at most MAX_VARYINGS, and the
+// fragment shader receives them interpolated with perspective correction in
+// fragment_batch.varyings.
+void render_model_varyings(SDL_display *display, model *m, camera *c,
+                           int flags, geometry_shader_fn geometry_shader,
+                           vertex_shader_fn vertex_shader,
+                           uint32_t varying_count,
+                           fragment_batch_fn fragment_batch) {
+  render_model_shaded(display, m, c, flags, geometry_shader, vertex_shader,
+                      varying_count, NULL, fragment_batch);
+}
+
+// Draws m's mesh once per instance, each with its own transform and colour
+// in place of m's position, rotation and scale and the white other draws
+// use. The mesh, the pipeline setup and the view are shared by every
+// instance, so only transforming and culling are paid per copy. Shaders are
+// as for render_model_varyings(); vertex_shader may be NULL.
+void render_model_instanced(SDL_display *display, model *m, camera *c,
+                            int flags, geometry_shader_fn geometry_shader,
+                            vertex_shader_fn vertex_shader,
+                            uint32_t varying_count,
+                            fragment_batch_fn fragment_batch,
+                            const model_instance *instances,
+                            uint32_t instance_count) {
+  flush_render_queue(display);
+  model_pipeline p;
+  setup_model_pipeline(&p, display, m, flags, geometry_shader, vertex_shader,
+                       varying_count, NULL, fragment_batch);
+  view_transform v;
+  setup_view_transform(&v, c, display->surface->w, display->surface->h,
+                       display->depth_format);
+
+  for (uint32_t i = 0; i < instance_count; i++) {
+    const model_instance *instance = &instances[i];
+    draw_transform t;
+    setup_model_transform(&t, &v, (float *)instance->position,
+                          (float *)instance->rotation,
+                          (float *)instance->scale, (vec3){0.0f, 0.0f, 0.0f});
+    render_mesh(&p, m, &t, instance->r, instance->g, instance->b);
+  }
+}
+
+// Sort keys order queued draws by, from the top bit down: pass, coarse
+// depth, state and exact depth. Early depth draws form the first pass and
+// RENDER_LATE_DEPTH ones the second, so shaders that cannot be skipped by
+// the depth test run over as much finished depth as possible. Within a pass
+// draws go front to back, but draws whose depths are within about a quarter
+// of each other share a coarse bucket and are grouped by state inside it,
+// trading a little depth order for fewer pipeline switches.
+#define RENDER_KEY_PASS_SHIFT 62
+#define RENDER_KEY_BUCKET_SHIFT 52
+#define RENDER_KEY_STATE_SHIFT 32
+#define RENDER_KEY_STATE_MASK 0xFFFFF
+
+// Shaders and flags of a run of queued draws, set up once per run.
+typedef struct {
+  int flags;
+  geometry_shader_fn geometry_shader;
+  vertex_shader_fn vertex_shader;
+  uint32_t varying_count;
+  fragment_shader_fn fragment_shader;
+  fragment_batch_fn fragment_batch;
+} queued_state;
+
+// The transform is taken when the draw is queued, so the model may move
+// before the flush, but its mesh must stay alive until then.
+typedef struct {
+  model *m;
+  uint32_t state;
+  draw_transform transform;
+} queued_draw;
+
+typedef struct {
+  uint64_t key;
+  uint32_t draw;
+} queued_key;
+
+struct render_queue {
+  queued_draw *draws;
+  queued_key *keys;
+  uint32_t draw_count;
+  uint32_t draw_capacity;
+
+  queued_state *states;
+  uint32_t state_count;
+  uint32_t state_capacity;
+};
+
+static void deallocate_render_queue(render_queue *queue) {
+  if (!queue)
+    return;
+  free(queue->draws);
+  free(queue->keys);
+  free(queue->states);
+  free(queue);
+}
+
+static int reserve_render_queue(render_queue *queue) {
+  if (queue->draw_count == queue->draw_capacity) {
+    uint32_t capacity = queue->draw_capacity ? queue->draw_capacity * 2 : 64;
+    queued_draw *draws = (queued_draw *)realloc(
+        queue->draws, capacity * sizeof(queued_draw));
+    VARIFYHEAP(draws, "reserve_render_queue()", 0)
+    queue->draws = draws;
+    queued_key *keys =
+        (queued_key *)realloc(queue->keys, capacity * sizeof(queued_key));
+    VARIFYHEAP(keys, "reserve_render_queue()", 0)
+    queue->keys = keys;
+    queue->draw_capacity = capacity;
+  }
+  if (queue->state_count == queue->state_capacity) {
+    uint32_t capacity = queue->state_capacity ? queue->state_capacity * 2 : 16;
+    queued_state *states = (queued_state *)realloc(
+        queue->states, capacity * sizeof(queued_state));
+    VARIFYHEAP(states, "reserve_render_queue()", 0)
+    queue->states = states;
+    queue->state_capacity = capacity;
+  }
+  return 1;
+}
+
+// Index of state in queue, added if this frame has not used it yet.
+static uint32_t find_queued_state(render_queue *queue,
+                                  const queued_state *state) {
+  for (uint32_t i = 0; i < queue->state_count; i++) {
+    const queued_state *s = &queue->states[i];
+    if (s->flags == state->flags &&
+        s->geometry_shader == state->geometry_shader &&
+        s->vertex_shader == state->vertex_shader &&
+        s->varying_count == state->varying_count &&
+        s->fragment_shader == state->fragment_shader &&
+        s->fragment_batch == state->fragment_batch)
+      return i;
+  }
+  queue->states[queue->state_count] = *state;
+  return queue->state_count++;
+}
+
+// View depth of the near side of m's bounding sphere under t, the same
+// measure cull_bounds3() uses, clamped at zero for a camera inside it.
+static float queued_draw_depth(const model *m, const draw_transform *t) {
+  const float(*mvp)[4] = t->mvp;
+  const bounds3 *b = &m->bounds;
+  float w = mvp[0][3] * b->center[0] + mvp[1][3] * b->center[1] +
+            mvp[2][3] * b->center[2] + mvp[3][3];
+  float depth = w - b->radius * t->max_scale;
+  return depth > 0.0f ? depth : 0.0f;
+}
+
+static int compare_queued_keys(const void *a, const void *b) {
+  const queued_key *x = (const queued_key *)a, *y = (const queued_key *)b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->draw < y->draw ? -1 : x->draw > y->draw;
+}
+
+static void queue_model_shaded(SDL_display *display, model *m, camera *c,
+                               int flags, geometry_shader_fn geometry_shader,
+                               vertex_shader_fn vertex_shader,
+                               uint32_t varying_count,
+                               fragment_shader_fn fragment_shader,
+                               fragment_batch_fn fragment_batch) {
+  if (!display->queue)
+    display->queue = (render_queue *)calloc(1, sizeof(render_queue));
+  render_queue *queue = display->queue;
+  // A draw the queue has no room for is made now, after the ones queued
+  // before it.
+  if (!queue || !reserve_render_queue(queue)) {
+    render_model_shaded(display, m, c, flags, geometry_shader, vertex_shader,
+                        varying_count, fragment_shader, fragment_batch);
+    return;
+  }
+
+  queued_state state = {flags,         geometry_shader, vertex_shader,
+                        varying_count, fragment_shader, fragment_batch};
+  uint32_t index = queue->draw_count++;
+  queued_draw *draw = &queue->draws[index];
+  draw->m = m;
+  draw->state = find_queued_state(queue, &state);
+  setup_draw_transform(&draw->transform, c, m->position, m->rotation,
+                       m->scale, (vec3){0.0f, 0.0f, 0.0f},
+                       display->surface->w, display->surface->h,
+                       display->depth_format);
+
+  // Non-negative floats order the same as their bits.
+  float depth = queued_draw_depth(m, &draw->transform);
+  uint32_t depth_bits;
+  memcpy(&depth_bits, &depth, sizeof(depth_bits));
+  uint64_t pass = (flags & RENDER_LATE_DEPTH) != 0;
+  queue->keys[index].key =
+      pass << RENDER_KEY_PASS_SHIFT |
+      (uint64_t)(depth_bits >> 21) << RENDER_KEY_BUCKET_SHIFT |
+      (uint64_t)(draw->state & RENDER_KEY_STATE_MASK)
+          << RENDER_KEY_STATE_SHIFT |
+      depth_bits;
+  queue->keys[index].draw = index;
+}
+
+// Same as render_model(), but the draw is held until the display is flushed
+// or cleared and then made in sorted order along with the rest of the queue,
+// see flush_render_queue(). Opaque results match drawing immediately up to
+// the order of fragments at exactly equal depth.
+void queue_model(SDL_display *display, model *m, camera *c, int flags,
+                 geometry_shader_fn geometry_shader,
+                 fragment_shader_fn fragment_shader) {
+  queue_model_shaded(display, m, c, flags, geometry_shader, NULL, 0,
+                     fragment_shader, NULL);
+}
+
+// Queued form of render_model_batched(), see queue_model().
+void queue_model_batched(SDL_display *display, model *m, camera *c, int flags,
+                         geometry_shader_fn geometry_shader,
+                         fragment_batch_fn fragment_batch) {
+  queue_model_shaded(display, m, c, flags, geometry_shader, NULL, 0, NULL,
+                     fragment_batch);
+}
+
+// Queued form of render_model_varyings(), see queue_model().
+void queue_model_varyings(SDL_display *display, model *m, camera *c, int flags,
+                          geometry_shader_fn geometry_shader,
+                          vertex_shader_fn vertex_shader,
+                          uint32_t varying_count,
+                          fragment_batch_fn fragment_batch) {
+  queue_model_shaded(display, m, c, flags, geometry_shader, vertex_shader,
+                     varying_count, NULL, fragment_batch);
+}
+
+// Makes every queued draw, ordered by sort key, and empties the queue. The
+// pipeline is only set up again where the state changes between draws.
+// Called by flush_display(), clear_display() and every immediate draw, so
+// callers rarely need to.
+void flush_render_queue(SDL_display *display) {
+  render_queue *queue = display->queue;
+  if (!queue || queue->draw_count == 0)
+    return;
+
+  qsort(queue->keys, queue->draw_count, sizeof(queued_key),
+        compare_queued_keys);
+
+  model_pipeline p;
+  uint32_t current = UINT32_MAX;
+  for (uint32_t i = 0; i < queue->draw_count; i++) {
+    queued_draw *draw = &queue->draws[queue->keys[i].draw];
+    if (draw->state != current) {
+      const queued_state *s = &queue->states[draw->state];
+      setup_model_pipeline(&p, display, draw->m, s->flags, s->geometry_shader,
+                           s->vertex_shader, s->varying_count,
+                           s->fragment_shader, s->fragment_batch);
+      current = draw->state;
     }
-    set_tri3d(display, *c, 255, 255, 255, m->tris[i].v1, m->tris[i].v2,
-              m->tris[i].v3, m->position, m->rotation, (vec3){0.0, 0.0f, 0.0f},
-              wframe, geometry_shader, fragment_shader);
+    p.target.texture = draw->m->texture;
+    render_mesh(&p, draw->m, &draw->transform, 255, 255, 255);
   }
+
+  queue->draw_count = 0;
+  queue->state_count = 0;
 }
@@ -18,15 +18,20 @@
 
 #define DEFAULT_BUFFER_SCALE_FACTOR 4
 
-#define DEFAULT_BUF_LEN                                                        \
-  (uint32_t)(((DEFAULT_BUFFER_WIDTH / DEFAULT_BUFFER_SCALE_FACTOR) *           \
-              (DEFAULT_BUFFER_HEIGHT / DEFAULT_BUFFER_SCALE_FACTOR)))
-typedef struct buffer {
-  uint32_t value[DEFAULT_BUF_LEN];
-} buffer;
+// The backbuffer is always allocated in this format, the one window surfaces
+// normally use, so presenting is a plain scaled copy and the rasterizer packs
+// pixels with fixed shifts.
+#define DISPLAY_PIXEL_FORMAT SDL_PIXELFORMAT_XRGB8888
+
+// Colour and depth rows start on cache-line boundaries, which also covers the
+// widest SIMD load the rasterizer issues.
+#define DISPLAY_BUFFER_ALIGN 64
+
+typedef struct render_queue render_queue;
 
 typedef struct SDL_display {
   SDL_Window *pointer;
+  int headless;
 
   uint16_t buffer_width;
   uint16_t buffer_height;
@@ -36,14 +41,46 @@ typedef struct SDL_display {
 
   const char *title;
 
+  // surface wraps pixels; zbuffer has the same pitch in elements, each
+  // depth_format_bytes(depth_format) wide. Both are sized from
+  // buffer_width/buffer_height at runtime, see resize_display().
   SDL_Surface *surface;
-  buffer zbuffer;
+  uint32_t *pixels;
+  void *zbuffer;
+  int depth_format;
+  // Coarse depth of zbuffer, see rasterize_tri_hiz().
+  hiz_buffer *hiz;
+
+  tile_binner *binner;
+  int thread_count;
+  int clear_mode;
+
+  // Draws made with queue_model() and friends, waiting for the next flush.
+  render_queue *queue;
 } SDL_display;
 
+#define DISPLAY_THREADS_AUTO -1
+
+// DISPLAY_CLEAR_IMMEDIATE fills colour and depth in clear_display().
+// DISPLAY_CLEAR_DEFERRED hands the clear to the tile binner, which folds it
+// into the next tile pass and skips depth in tiles nothing is drawn to; it
+// behaves like IMMEDIATE while the display has no worker threads.
+#define DISPLAY_CLEAR_IMMEDIATE 0
+#define DISPLAY_CLEAR_DEFERRED 1
+
 SDL_display *allocate_display(uint16_t width, uint16_t height,
                               const char *title);
+SDL_display *allocate_display_headless(uint16_t width, uint16_t height);
 void deallocate_display(SDL_display *display);
 void cycle_display(SDL_display *display);
+int resize_display(SDL_display *display, uint16_t buffer_width,
+                   uint16_t buffer_height);
+void set_display_thread_count(SDL_display *display, int thread_count);
+void set_display_clear_mode(SDL_display *display, int clear_mode);
+int set_display_depth_format(SDL_display *display, int depth_format);
+void flush_display(SDL_display *display);
+const uint32_t *get_display_pixels(SDL_display *display, uint16_t *pitch);
+void read_display_pixels(SDL_display *display, uint8_t *rgb);
 void set_pixel(SDL_display *display, uint16_t x, uint16_t y, uint8_t r,
                uint8_t g, uint8_t b);
 void set_line(SDL_display *display, uint8_t r, uint8_t g, uint8_t b,
@@ -61,33 +98,241 @@ void set_tri3d(SDL_display *display, camera c, uint8_t r, uint8_t g, uint8_t b,
                                        vec3 position, vec3 normal));
 void clear_display(SDL_display *display, uint8_t r, uint8_t g, uint8_t b);
 
-#define MAX_TRI_COUNT 1024
-
 #define SHAPE_NONE 0
 #define SHAPE_CUBE 1
 #define SHAPE_PYRAMID 2
 #define SHAPE_ICO_SPHERE 3
 #define SHAPE_TERRAIN 4
 
+#define TERRAIN_SIZE 20
+
 typedef struct tri {
   vec3 v1;
   vec3 v2;
   vec3 v3;
 } tri;
 
+typedef struct mesh_mapping mesh_mapping;
+
+// Most triangles a model is built from, which keeps corner counts and the
+// tables used to weld them well inside 32 bits.
+#define MAX_MODEL_TRIS (1u << 22)
+
+// Vertices are in object space; position, rotation and scale are applied by
+// the model matrix when the model is drawn.
 typedef struct model {
   vec3 position;
   vec3 rotation;
   vec3 scale;
 
-  tri tris[MAX_TRI_COUNT];
+  vec3 *vertices;
+  uint32_t vertex_count;
+  uint32_t *indices;
+  uint32_t tri_count;
+
+  vec4 *clip_cache;
+  // Unit normal per triangle, wound like indices.
+  vec3 *face_normals;
+  // Per vertex: unit normal averaged over the faces sharing the vertex,
+  // texture coordinate, and MAX_VARYINGS floats of vertex shader output.
+  vec3 *normals;
+  vec2 *uvs;
+  float *varying_cache;
+
+  // Texture handed to the fragment shader, or NULL. Not owned by the model.
+  const texture *texture;
+
+  // Set when the mesh arrays point into a mapped mesh file rather than
+  // owning heap memory, see init_model_mesh().
+  mesh_mapping *mapping;
+
+  // Object-space bounds of vertices, checked by render_model() before any
+  // per-vertex work.
+  bounds3 bounds;
 } model;
 
-void init_model(model *model, tri *tris, vec3 position, vec3 rotation,
-                vec3 scale, int SHAPE);
-void render_model(SDL_display *display, model *m, camera *c, int wframe,
+// One copy of a model's mesh drawn by render_model_instanced().
+typedef struct {
+  vec3 position;
+  vec3 rotation;
+  vec3 scale;
+  uint8_t r, g, b;
+} model_instance;
+
+void init_model(model *model, tri *tris, uint32_t tri_count, vec3 position,
+                vec3 rotation, vec3 scale, int SHAPE);
+void deallocate_model(model *model);
+int init_model_attributes(model *model);
+int allocate_model_caches(model *model);
+int init_model_obj(model *model, const char *path, vec3 position,
+                   vec3 rotation, vec3 scale);
+int init_model_mesh(model *model, const char *path, vec3 position,
+                    vec3 rotation, vec3 scale);
+int write_model_mesh(const model *model, const char *path);
+void unmap_mesh_file(mesh_mapping *mapping);
+void render_model(SDL_display *display, model *m, camera *c, int flags,
                   void (*geometry_shader)(vec4 OUT, vec3 normal, vec2 uv,
                                           vec3 position, vec3 light_dir,
                                           uint8_t r, uint8_t g, uint8_t b),
                   void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv,
                                           vec3 position, vec3 normal));
+void render_model_batched(SDL_display *display, model *m, camera *c, int flags,
+                          geometry_shader_fn geometry_shader,
+                          fragment_batch_fn fragment_batch);
+void render_model_varyings(SDL_display *display, model *m, camera *c,
+                           int flags, geometry_shader_fn geometry_shader,
+                           vertex_shader_fn vertex_shader,
+                           uint32_t varying_count,
+                           fragment_batch_fn fragment_batch);
+void render_model_instanced(SDL_display *display, model *m, camera *c,
+                            int flags, geometry_shader_fn geometry_shader,
+                            vertex_shader_fn vertex_shader,
+                            uint32_t varying_count,
+                            fragment_batch_fn fragment_batch,
+                            const model_instance *instances,
+                            uint32_t instance_count);
+void queue_model(SDL_display *display, model *m, camera *c, int flags,
+                 geometry_shader_fn geometry_shader,
+                 fragment_shader_fn fragment_shader);
+void queue_model_batched(SDL_display *display, model *m, camera *c, int flags,
+                         geometry_shader_fn geometry_shader,
+                         fragment_batch_fn fragment_batch);
+void queue_model_varyings(SDL_display *display, model *m, camera *c, int flags,
+                          geometry_shader_fn geometry_shader,
+                          vertex_shader_fn vertex_shader,
+                          uint32_t varying_count,
+                          fragment_batch_fn fragment_batch);
+void flush_render_queue(SDL_display *display);
+
+// Command buffers record frames as a flat list of commands in one growable
+// block, which execute_command_buffer() later replays against a display.
+// Recording copies everything a command needs except meshes and shaders,
+// which it refers to, so a buffer can be built away from the display and
+// executed any number of times while those stay alive.
+#define COMMAND_CLEAR 1
+#define COMMAND_CAMERA 2
+#define COMMAND_MODEL 3
+#define COMMAND_INSTANCED 4
+#define COMMAND_LINE 5
+
+// Every command's size is a multiple of this, so the next one is aligned.
+#define COMMAND_ALIGN 8
+
+typedef void (*command_fn)(void);
+
+// A model or shader a command refers to. It holds a pointer while recorded
+// and an index into a command_table while saved to a file.
+typedef union {
+  void *object;
+  command_fn function;
+  uint64_t index;
+} command_ref;
+
+typedef struct {
+  uint32_t type;
+  uint32_t size;
+} command_header;
+
+typedef struct {
+  command_header header;
+  uint8_t r, g, b;
+} clear_command;
+
+typedef struct {
+  command_header header;
+  camera camera;
+} camera_command;
+
+// Drawn through the render queue with the model's transform as it was
+// recorded; fragment_shader is set for render_model() style draws and
+// fragment_batch for the others.
+typedef struct {
+  command_header header;
+  command_ref model;
+  command_ref geometry_shader;
+  command_ref vertex_shader;
+  command_ref fragment_shader;
+  command_ref fragment_batch;
+  int32_t flags;
+  uint32_t varying_count;
+  vec3 position;
+  vec3 rotation;
+  vec3 scale;
+} model_command;
+
+typedef struct {
+  command_header header;
+  command_ref model;
+  command_ref geometry_shader;
+  command_ref vertex_shader;
+  command_ref fragment_batch;
+  int32_t flags;
+  uint32_t varying_count;
+  uint32_t instance_count;
+  model_instance instances[];
+} instanced_command;
+
+typedef struct {
+  command_header header;
+  uint16_t x1, y1, x2, y2;
+  uint8_t r, g, b;
+} line_command;
+
+typedef struct {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  uint32_t count;
+} command_buffer;
+
+// The models and shaders saved command buffers may refer to. Saving writes
+// references as positions in these tables and loading turns them back into
+// pointers, so a capture replays in any run of the same build that passes
+// the same tables. Each kind of shader has its own table, so a loaded
+// reference always has the type its command expects.
+typedef struct {
+  model *const *models;
+  uint32_t model_count;
+  const geometry_shader_fn *geometry_shaders;
+  uint32_t geometry_shader_count;
+  const vertex_shader_fn *vertex_shaders;
+  uint32_t vertex_shader_count;
+  const fragment_shader_fn *fragment_shaders;
+  uint32_t fragment_shader_count;
+  const fragment_batch_fn *fragment_batches;
+  uint32_t fragment_batch_count;
+} command_table;
+
+void reset_command_buffer(command_buffer *commands);
+void deallocate_command_buffer(command_buffer *commands);
+const command_header *next_command(const command_buffer *commands,
+                                   const command_header *command);
+void record_clear(command_buffer *commands, uint8_t r, uint8_t g, uint8_t b);
+void record_camera(command_buffer *commands, const camera *c);
+void record_model(command_buffer *commands, model *m, int flags,
+                  geometry_shader_fn geometry_shader,
+                  fragment_shader_fn fragment_shader);
+void record_model_batched(command_buffer *commands, model *m, int flags,
+                          geometry_shader_fn geometry_shader,
+                          fragment_batch_fn fragment_batch);
+void record_model_varyings(command_buffer *commands, model *m, int flags,
+                           geometry_shader_fn geometry_shader,
+                           vertex_shader_fn vertex_shader,
+                           uint32_t varying_count,
+                           fragment_batch_fn fragment_batch);
+void record_model_instanced(command_buffer *commands, model *m, int flags,
+                            geometry_shader_fn geometry_shader,
+                            vertex_shader_fn vertex_shader,
+                            uint32_t varying_count,
+                            fragment_batch_fn fragment_batch,
+                            const model_instance *instances,
+                            uint32_t instance_count);
+void record_line(command_buffer *commands, uint8_t r, uint8_t g, uint8_t b,
+                 uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2);
+void execute_command_buffer(SDL_display *display,
+                            const command_buffer *commands);
+int save_command_buffers(const command_buffer *buffers, uint32_t count,
+                         const command_table *table, const char *path);
+command_buffer *load_command_buffers(const char *path,
+                                     const command_table *table,
+                                     uint32_t *count);
@@ -1,4 +1,5 @@
 #include "game.h"
+#include "raster_template.h"
 
 #define PITCH_MIN -89.0f
 #define PITCH_MAX  89.0f
@@ -64,13 +65,14 @@ void terrain_geo_shader(vec4 OUT, vec3 normal, vec2 uv, vec3 position, vec3 ligh
     OUT[3] = 255.0f;
 }
 
-void terrain_frag_shader(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
-                          vec3 normal) {
-    OUT[0] = position[0] * IN[0];
-    OUT[1] = position[1] * IN[1];
-    OUT[2] = position[2] * IN[2];
+void terrain_frag_shader(fragment_batch *f) {
+    for (int l = 0; l < FRAGMENT_BATCH_SIZE; l++) {
+        f->out[0][l] = f->position[0][l] * f->in[0];
+        f->out[1][l] = f->position[1][l] * f->in[1];
+        f->out[2][l] = f->position[2][l] * f->in[2];
 
-    OUT[3] = IN[3];
+        f->out[3][l] = f->in[3];
+    }
 }
 
 void model_geo_shader(vec4 OUT, vec3 normal, vec2 uv, vec3 position, vec3 light_dir, 
@@ -91,15 +93,45 @@ void model_geo_shader(vec4 OUT, vec3 normal, vec2 uv, vec3 position, vec3 light_
 }
 
 
-void model_frag_shader(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
-                          vec3 normal) { 
-    OUT[0] = position[0] * IN[0];
-    OUT[1] = position[1] * IN[1];
-    OUT[2] = position[2] * IN[2];
+// Model varyings: world space normal, then texture coordinate.
+#define MODEL_VARYINGS 5
 
-    OUT[3] = IN[3];
+void model_vertex_shader(float *out, const vec3 position, const vec3 normal,
+            const vec2 uv, const draw_transform *t) {
+    (void)position;
+
+    const float (*m)[4] = t->normal_matrix;
+    for (int i = 0; i < 3; i++)
+        out[i] = normal[0] * m[0][i] + normal[1] * m[1][i] + normal[2] * m[2][i];
+    out[3] = uv[0];
+    out[4] = uv[1];
+}
+
+// Per-pixel diffuse from the interpolated normal over the model's texture.
+void model_frag_shader(fragment_batch *f) {
+    float texel[4][FRAGMENT_BATCH_SIZE];
+    sample_texture_batch(f->texture, TEXTURE_FILTER_BILINEAR, f, 3, texel);
+
+    for (int l = 0; l < FRAGMENT_BATCH_SIZE; l++) {
+        float nx = f->varyings[0][l];
+        float ny = f->varyings[1][l];
+        float nz = f->varyings[2][l];
+        float len = sqrtf(nx * nx + ny * ny + nz * nz) + 1e-6f;
+        float dot = 0.5f * (nx + ny + nz) / len;
+        float brightness = fminf(1.0f, fmaxf(0.0f, dot) + 0.21f);
+
+        f->out[0][l] = brightness * texel[0][l];
+        f->out[1][l] = brightness * texel[1][l];
+        f->out[2][l] = brightness * texel[2][l];
+
+        f->out[3][l] = f->in[3];
+    }
 }
 
+// Pixel loops with the fragment shaders above inlined, for every depth format.
+DEFINE_RASTER_VARIANTS(terrain_raster_variants, terrain_frag_shader, 0);
+DEFINE_RASTER_VARIANTS(model_raster_variants, model_frag_shader, 0);
+
 camera main_camera = {
     .near = 0.01f,
     .far = 150.0f,
@@ -110,6 +142,35 @@ camera main_camera = {
 
 model test_model;
 model terrain;
+texture *crate_texture;
+
+// Reused every frame, so recording allocates nothing once it has grown.
+static command_buffer frame_commands;
+
+#define CRATE_TEXTURE_SIZE 64
+
+// Planks with dark seams and a frame around the edge, generated so the game
+// has no asset files to ship.
+static texture *create_crate_texture(void) {
+  uint8_t *rgb = (uint8_t *)malloc(CRATE_TEXTURE_SIZE * CRATE_TEXTURE_SIZE * 3);
+  if (!rgb)
+    return NULL;
+  for (int y = 0; y < CRATE_TEXTURE_SIZE; y++)
+    for (int x = 0; x < CRATE_TEXTURE_SIZE; x++) {
+      int frame = x < 6 || y < 6 || x >= CRATE_TEXTURE_SIZE - 6 ||
+                  y >= CRATE_TEXTURE_SIZE - 6;
+      int seam = y % 13 == 0;
+      float grain = 0.85f + 0.15f * sinf(x * 0.7f + (y / 13) * 2.1f);
+      float shade = seam ? 0.45f : frame ? 0.7f : grain;
+      uint8_t *p = rgb + (y * CRATE_TEXTURE_SIZE + x) * 3;
+      p[0] = (uint8_t)(200.0f * shade);
+      p[1] = (uint8_t)(150.0f * shade);
+      p[2] = (uint8_t)(90.0f * shade);
+    }
+  texture *t = create_texture(CRATE_TEXTURE_SIZE, CRATE_TEXTURE_SIZE, rgb, 3);
+  free(rgb);
+  return t;
+}
 
 void init_game() {
   main_player.cam = &main_camera;
@@ -117,29 +178,93 @@ void init_game() {
   main_player.position[1] = -7.0f;
   main_player.position[2] = -7.0f;
 
-  init_model(&terrain, NULL,
+  register_raster_variants(terrain_raster_variants, DEPTH_FORMAT_COUNT);
+  register_raster_variants(model_raster_variants, DEPTH_FORMAT_COUNT);
+
+  init_model(&terrain, NULL, 0,
              (vec3){-15.0f, 0.0f, -15.0f},
              (vec3){0.0f, 0.0f, 0.0f},
              (vec3){1.0f, 1.0f, 1.0f},
              SHAPE_TERRAIN);
 
-  init_model(&test_model, NULL,
+  init_model(&test_model, NULL, 0,
              (vec3){0.0f, -1.5f, 5.0f},
              (vec3){0.0f, 0.0f, 0.0f},
              (vec3){1.0f, 1.0f, 1.0f},
              SHAPE_CUBE);
+
+  if (!crate_texture)
+    crate_texture = create_crate_texture();
+  test_model.texture = crate_texture;
+}
+
+// Releases what init_game() allocated.
+void deallocate_game() {
+  deallocate_model(&terrain);
+  deallocate_model(&test_model);
+  if (crate_texture)
+    deallocate_texture(crate_texture);
+  crate_texture = NULL;
+  test_model.texture = NULL;
+  deallocate_command_buffer(&frame_commands);
 }
 
 void update_game(double deltatime, SDL_Event event) {
   update_player_controller(&main_player, deltatime, event);
 }
 
-void update_graphics(SDL_display *display) {
-  clear_display(display, 15, 20, 45);
+// Fixed camera path for benchmark replays: a slow forward drift over the
+// terrain with a sideways sway, driven only by the frame index.
+void update_game_scripted(double deltatime, uint32_t frame) {
+  float t = (float)(deltatime * frame);
+
+  main_player.position[0] = 4.0f * sinf(t * 0.5f);
+  main_player.position[1] = -7.0f + 1.5f * sinf(t * 0.25f);
+  main_player.position[2] = -7.0f + MOVE_SPEED * t;
+
+  main_player.cam->position[0] = main_player.position[0];
+  main_player.cam->position[1] = main_player.position[1] - 1.2f;
+  main_player.cam->position[2] = main_player.position[2];
+}
+
+// Records one frame of the scene. Everything it draws is listed in
+// game_command_table(), so a recorded frame can be saved and replayed.
+void record_graphics(command_buffer *commands) {
+  record_clear(commands, 15, 20, 45);
 
   main_camera.rotation[0] -= 0.05f;
   test_model.rotation[1] += 0.5f;
 
-  render_model(display, &terrain, main_player.cam, false, terrain_geo_shader, terrain_frag_shader);
-  render_model(display, &test_model, main_player.cam, false, model_geo_shader, model_frag_shader);
+  record_camera(commands, main_player.cam);
+  record_model_batched(commands, &terrain, false, terrain_geo_shader, terrain_frag_shader);
+  record_model_varyings(commands, &test_model, false, model_geo_shader, model_vertex_shader, MODEL_VARYINGS, model_frag_shader);
+}
+
+void update_graphics(SDL_display *display) {
+  reset_command_buffer(&frame_commands);
+  record_graphics(&frame_commands);
+  execute_command_buffer(display, &frame_commands);
+}
+
+#define ARRAY_COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+static model *const game_models[] = {&terrain, &test_model};
+static const geometry_shader_fn game_geometry_shaders[] = {terrain_geo_shader,
+                                                          model_geo_shader};
+static const vertex_shader_fn game_vertex_shaders[] = {model_vertex_shader};
+static const fragment_batch_fn game_fragment_batches[] = {terrain_frag_shader,
+                                                          model_frag_shader};
+
+const command_table *game_command_table(void) {
+  static const command_table table = {
+      .models = game_models,
+      .model_count = ARRAY_COUNT(game_models),
+      .geometry_shaders = game_geometry_shaders,
+      .geometry_shader_count = ARRAY_COUNT(game_geometry_shaders),
+      .vertex_shaders = game_vertex_shaders,
+      .vertex_shader_count = ARRAY_COUNT(game_vertex_shaders),
+      .fragment_batches = game_fragment_batches,
+      .fragment_batch_count = ARRAY_COUNT(game_fragment_batches),
+  };
+  return &table;
 }
@@ -1,5 +1,9 @@
 #include "app.h"
 
 void init_game();
+void deallocate_game();
 void update_game(double deltatime, SDL_Event event);
+void update_game_scripted(double deltatime, uint32_t frame);
 void update_graphics(SDL_display *display);
+void record_graphics(command_buffer *commands);
+const command_table *game_command_table(void);
@@ -1,4 +1,5 @@
 #include "graphics.h"
+#include "raster_template.h"
 
 #define VARIFYHEAP(ptr, str, type)                                             \
   do {                                                                         \
@@ -8,36 +9,19 @@
     }                                                                          \
   } while (0)
 
+static render_stats stats;
+
 static int min(int a, int b) { return a < b ? a : b; }
 static int max(int a, int b) { return a > b ? a : b; }
 
-static void set_pixel(SDL_Surface *s, uint16_t x, uint16_t y, uint8_t r,
-                      uint8_t g, uint8_t b) {
+static void set_pixel(SDL_Surface *s, uint16_t x, uint16_t y, uint32_t pixel) {
   if (x >= (uint16_t)s->w || y >= (uint16_t)s->h)
     return;
-  uint32_t v = SDL_MapRGB(s->format, r, g, b);
-  ((uint32_t *)s->pixels)[y * (s->pitch / 4) + x] = v;
+  ((uint32_t *)s->pixels)[y * (s->pitch / 4) + x] = pixel;
 }
 
-static void set_pixel_zbuffered(SDL_Surface *s, uint32_t *zbuffer, uint16_t x,
-                                uint16_t y, uint8_t r, uint8_t g, uint8_t b,
-                                float z) {
-  if (x >= (uint16_t)s->w || y >= (uint16_t)s->h)
-    return;
-  uint32_t pixel_index_pixels = y * (s->pitch / 4) + x;
-  uint32_t pixel_index_z = y * s->w + x;
-
-  float z_clamped = fmaxf(0.0f, fminf(1.0f, z));
-  uint32_t z_int = (uint32_t)(z_clamped * 4294967295.0f);
-
-  if (z_int < zbuffer[pixel_index_z]) {
-    zbuffer[pixel_index_z] = z_int;
-    uint32_t v = SDL_MapRGB(s->format, r, g, b);
-    ((uint32_t *)s->pixels)[pixel_index_pixels] = v;
-  }
-}
-
-static bbox2i calculate_bbox2i_from_tri(vec2i v1, vec2i v2, vec2i v3) {
+static bbox2i calculate_bbox2i_from_tri(const vec2i v1, const vec2i v2,
+                                        const vec2i v3) {
   bbox2i b = {.min = {v1[0], v1[1]}, .max = {v1[0], v1[1]}};
   if (v2[0] < b.min[0])
     b.min[0] = v2[0];
@@ -119,7 +103,7 @@ static inline void mat4_vec3_mul_normal(vec3 out, const mat4 m, const vec3 v) {
   out[2] = x * m[0][2] + y * m[1][2] + z * m[2][2];
 }
 
-static void mat4_transform_clip(vec4 out, vec3 v, mat4 m) {
+static void mat4_transform_clip(vec4 out, const vec3 v, const mat4 m) {
   float x = v[0], y = v[1], z = v[2];
   out[0] = x * m[0][0] + y * m[1][0] + z * m[2][0] + m[3][0];
   out[1] = x * m[0][1] + y * m[1][1] + z * m[2][1] + m[3][1];
@@ -127,9 +111,40 @@ static void mat4_transform_clip(vec4 out, vec3 v, mat4 m) {
   out[3] = x * m[0][3] + y * m[1][3] + z * m[2][3] + m[3][3];
 }
 
+// Clip planes for clip_polygon_component(): keep component <= scale * w,
+// component >= -scale * w, or component >= 0.
+#define CLIP_NEGATIVE 0
+#define CLIP_POSITIVE 1
+#define CLIP_ZERO 2
+
+// Each clip plane can add one vertex to the triangle.
+#define CLIP_MAX_VERTS 9
+
+static float clip_boundary(const clip_vertex *v, int component, int plane,
+                           float w_scale) {
+  float val = v->p[component];
+  if (plane == CLIP_ZERO)
+    return val;
+  float w = v->w * w_scale;
+  return plane == CLIP_POSITIVE ? w - val : w + val;
+}
+
+static void lerp_clip_vertex(clip_vertex *out, const clip_vertex *a,
+                             const clip_vertex *b, float t,
+                             int varying_count) {
+  out->p[0] = a->p[0] + t * (b->p[0] - a->p[0]);
+  out->p[1] = a->p[1] + t * (b->p[1] - a->p[1]);
+  out->p[2] = a->p[2] + t * (b->p[2] - a->p[2]);
+  out->w = a->w + t * (b->w - a->w);
+  for (int k = 0; k < varying_count; ++k)
+    out->varyings[k] =
+        a->varyings[k] + t * (b->varyings[k] - a->varyings[k]);
+}
+
 static void clip_polygon_component(clip_vertex *input, int in_count,
                                    clip_vertex *output, int *out_count,
-                                   int component, int positive) {
+                                   int component, int plane, float w_scale,
+                                   int varying_count) {
   *out_count = 0;
 
   if (in_count == 0)
@@ -140,13 +155,8 @@ static void clip_polygon_component(clip_vertex *input, int in_count,
   for (int i = 0; i < in_count; ++i) {
     clip_vertex curr = input[i];
 
-    float prev_val =
-        component == 0 ? prev.p[0] : (component == 1 ? prev.p[1] : prev.p[2]);
-    float curr_val =
-        component == 0 ? curr.p[0] : (component == 1 ? curr.p[1] : curr.p[2]);
-
-    float prev_boundary = positive ? (prev.w - prev_val) : (prev.w + prev_val);
-    float curr_boundary = positive ? (curr.w - curr_val) : (curr.w + curr_val);
+    float prev_boundary = clip_boundary(&prev, component, plane, w_scale);
+    float curr_boundary = clip_boundary(&curr, component, plane, w_scale);
 
     int prev_inside = (prev_boundary >= 0);
     int curr_inside = (curr_boundary >= 0);
@@ -154,28 +164,102 @@ static void clip_polygon_component(clip_vertex *input, int in_count,
     if (curr_inside) {
       if (!prev_inside) {
         float t = prev_boundary / (prev_boundary - curr_boundary);
-        clip_vertex new_vert;
-        new_vert.p[0] = prev.p[0] + t * (curr.p[0] - prev.p[0]);
-        new_vert.p[1] = prev.p[1] + t * (curr.p[1] - prev.p[1]);
-        new_vert.p[2] = prev.p[2] + t * (curr.p[2] - prev.p[2]);
-        new_vert.w = prev.w + t * (curr.w - prev.w);
-        output[(*out_count)++] = new_vert;
+        lerp_clip_vertex(&output[(*out_count)++], &prev, &curr, t,
+                         varying_count);
       }
       output[(*out_count)++] = curr;
     } else if (prev_inside) {
       float t = prev_boundary / (prev_boundary - curr_boundary);
-      clip_vertex new_vert;
-      new_vert.p[0] = prev.p[0] + t * (curr.p[0] - prev.p[0]);
-      new_vert.p[1] = prev.p[1] + t * (curr.p[1] - prev.p[1]);
-      new_vert.p[2] = prev.p[2] + t * (curr.p[2] - prev.p[2]);
-      new_vert.w = prev.w + t * (curr.w - prev.w);
-      output[(*out_count)++] = new_vert;
+      lerp_clip_vertex(&output[(*out_count)++], &prev, &curr, t,
+                       varying_count);
     }
 
     prev = curr;
   }
 }
 
+// Outcode bits of a clip-space vertex. OUTCODE_REJECT bits mark it outside
+// one of the planes bounding what can be seen; a triangle with all three
+// vertices outside the same one is dropped unclipped. OUTCODE_CLIP bits mark
+// the planes a triangle must really be clipped against: depth, and the guard
+// band past which screen positions would overflow the rasterizer. Anything
+// between the viewport and the guard band is left to the rasterizer's
+// scissor.
+#define OUTCODE_LEFT 0x01
+#define OUTCODE_RIGHT 0x02
+#define OUTCODE_BOTTOM 0x04
+#define OUTCODE_TOP 0x08
+#define OUTCODE_NEAR_Z 0x10
+#define OUTCODE_FAR_Z 0x20
+#define OUTCODE_GUARD_X 0x40
+#define OUTCODE_GUARD_Y 0x80
+#define OUTCODE_REJECT 0x3F
+#define OUTCODE_CLIP 0xF0
+
+// Depth bits are named for the default depth range: z < 0 is in front of
+// the near plane and z > w is past the far plane. Reversed Z swaps the two
+// planes, which clipping does not care about.
+static uint8_t clip_outcode(const vec4 c, float guard_x, float guard_y) {
+  float w = c[3];
+  uint8_t code = 0;
+  code |= c[0] < -w ? OUTCODE_LEFT : 0;
+  code |= c[0] > w ? OUTCODE_RIGHT : 0;
+  code |= c[1] < -w ? OUTCODE_BOTTOM : 0;
+  code |= c[1] > w ? OUTCODE_TOP : 0;
+  code |= c[2] < 0.0f ? OUTCODE_NEAR_Z : 0;
+  code |= c[2] > w ? OUTCODE_FAR_Z : 0;
+  code |= fabsf(c[0]) > guard_x * w ? OUTCODE_GUARD_X : 0;
+  code |= fabsf(c[1]) > guard_y * w ? OUTCODE_GUARD_Y : 0;
+  return code;
+}
+
+// Clips the polygon in verts against only the planes named in crossed, the
+// OUTCODE_CLIP bits set by any of its vertices. Depth goes first so the
+// guard band planes only ever see w > 0. Returns the new vertex count.
+static int clip_polygon_outcodes(clip_vertex *verts, int count,
+                                 uint8_t crossed, float guard_x, float guard_y,
+                                 int varying_count) {
+  static const struct {
+    uint8_t code;
+    int component;
+    int plane;
+  } planes[] = {
+      {OUTCODE_NEAR_Z, 2, CLIP_ZERO},     {OUTCODE_FAR_Z, 2, CLIP_POSITIVE},
+      {OUTCODE_GUARD_X, 0, CLIP_NEGATIVE}, {OUTCODE_GUARD_X, 0, CLIP_POSITIVE},
+      {OUTCODE_GUARD_Y, 1, CLIP_NEGATIVE}, {OUTCODE_GUARD_Y, 1, CLIP_POSITIVE},
+  };
+
+  clip_vertex temp[CLIP_MAX_VERTS];
+  for (size_t i = 0; i < sizeof(planes) / sizeof(planes[0]); ++i) {
+    if (!(crossed & planes[i].code))
+      continue;
+    float w_scale = planes[i].component == 0   ? guard_x
+                    : planes[i].component == 1 ? guard_y
+                                               : 1.0f;
+    int out_count;
+    clip_polygon_component(verts, count, temp, &out_count,
+                           planes[i].component, planes[i].plane, w_scale,
+                           varying_count);
+    count = out_count;
+    if (count < 3)
+      return 0;
+    memcpy(verts, temp, count * sizeof(clip_vertex));
+  }
+  return count;
+}
+
+void reset_render_stats(void) { memset(&stats, 0, sizeof(stats)); }
+
+void add_render_stats(const render_stats *delta) {
+  stats.models_culled += delta->models_culled;
+  stats.triangles_culled += delta->triangles_culled;
+  stats.triangles_submitted += delta->triangles_submitted;
+  stats.triangles_rasterized += delta->triangles_rasterized;
+  stats.pixels_shaded += delta->pixels_shaded;
+}
+
+render_stats get_render_stats(void) { return stats; }
+
 void update_view_matrix(mat4 *mat, camera c) {
   float cx = cosf(c.rotation[0] * 3.14159265f / 180.0f);
   float sx = sinf(c.rotation[0] * 3.14159265f / 180.0f);
@@ -280,8 +364,9 @@ void update_model_matrix(mat4 *mat, vec3 pos, vec3 pivot, vec3 rot_deg) {
       (*mat)[i][j] = M[i][j];
 }
 
+// Maps view depth near..far to NDC z 0..1, or 1..0 for reversed-Z formats.
 void update_projection_matrix(mat4 *mat, camera c, uint16_t width,
-                              uint16_t height) {
+                              uint16_t height, int depth_format) {
   float f = 1.0f / tanf(c.fovy * 0.5f * 3.14159265f / 180.0f);
   float a = (float)height / (float)width;
   float q = c.far / (c.far - c.near);
@@ -289,10 +374,61 @@ void update_projection_matrix(mat4 *mat, camera c, uint16_t width,
   memset(mat, 0, sizeof(mat4));
   (*mat)[0][0] = f * a;
   (*mat)[1][1] = -f;
-  (*mat)[2][2] = q;
   (*mat)[2][3] = 1.0f;
-  (*mat)[3][2] = -c.near * q;
   (*mat)[3][3] = 0.0f;
+  if (depth_format == DEPTH_FLOAT32_REVERSED) {
+    (*mat)[2][2] = -c.near / (c.far - c.near);
+    (*mat)[3][2] = c.near * q;
+  } else {
+    (*mat)[2][2] = q;
+    (*mat)[3][2] = -c.near * q;
+  }
+}
+
+void setup_view_transform(view_transform *v, const camera *c,
+                          uint16_t width, uint16_t height, int depth_format) {
+  update_view_matrix(&v->view, *c);
+  update_projection_matrix(&v->proj, *c, width, height, depth_format);
+  memcpy(v->camera_position, c->position, sizeof(vec3));
+  v->pixel_scale = fabsf(v->proj[1][1]) * (float)height * 0.5f;
+  v->guard_x = (float)RASTER_MAX_SPAN / (float)width;
+  v->guard_y = (float)RASTER_MAX_SPAN / (float)height;
+}
+
+// The model matrix scales along the object axes first, then rotates about
+// pivot and translates by pos.
+void setup_model_transform(draw_transform *t, const view_transform *v,
+                           vec3 pos, vec3 rot, vec3 scale, vec3 pivot) {
+  mat4 model, mv;
+  update_model_matrix(&model, pos, pivot, rot);
+  t->max_scale = 0.0f;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j)
+      model[i][j] *= scale[i];
+    t->max_scale = fmaxf(t->max_scale, fabsf(scale[i]));
+  }
+  mat4_mul(mv, v->view, model);
+  mat4_mul(t->mvp, v->proj, mv);
+  memcpy(t->model, model, sizeof(mat4));
+  t->pixel_scale = v->pixel_scale;
+  t->guard_x = v->guard_x;
+  t->guard_y = v->guard_y;
+
+  mat4 model_inv;
+  mat4_inverse(model_inv, model);
+  mat4_transpose(t->normal_matrix, model_inv);
+  const float *eye = v->camera_position;
+  for (int i = 0; i < 3; ++i)
+    t->eye[i] = model_inv[0][i] * eye[0] + model_inv[1][i] * eye[1] +
+                model_inv[2][i] * eye[2] + model_inv[3][i];
+}
+
+void setup_draw_transform(draw_transform *t, const camera *c, vec3 pos,
+                          vec3 rot, vec3 scale, vec3 pivot, uint16_t width,
+                          uint16_t height, int depth_format) {
+  view_transform v;
+  setup_view_transform(&v, c, width, height, depth_format);
+  setup_model_transform(t, &v, pos, rot, scale, pivot);
 }
 
 void draw_line_to_backbuffer(SDL_Surface *surface, uint8_t r, uint8_t g,
@@ -307,14 +443,14 @@ void draw_line_to_backbuffer(SDL_Surface *surface, uint8_t r, uint8_t g,
   int sx = x1 < x2 ? 1 : -1;
   int sy = y1 < y2 ? 1 : -1;
   int err = dx - dy;
-  uint32_t pixel = SDL_MapRGB(surface->format, r, g, b);
+  uint32_t pixel = pack_pixel(get_pixel_packing(surface), r, g, b);
   uint32_t *pixels = (uint32_t *)surface->pixels;
-  int w = surface->w;
+  int pitch = surface->pitch / 4;
 
   while (1) {
     if (x1 < surface->clip_rect.w && y1 < surface->clip_rect.h &&
         x1 >= surface->clip_rect.x && y1 >= surface->clip_rect.y)
-      pixels[w * y1 + x1] = pixel;
+      pixels[pitch * y1 + x1] = pixel;
     if (x1 == x2 && y1 == y2)
       break;
     int e2 = err * 2;
@@ -336,9 +472,10 @@ void draw_wireframe_tri_to_backbuffer(SDL_Surface *surface, vec2i v1, vec2i v2,
     draw_line_to_backbuffer(surface, 255, 0, 0, v1[0], v1[1], v2[0], v2[1]);
     draw_line_to_backbuffer(surface, 0, 255, 0, v2[0], v2[1], v3[0], v3[1]);
     draw_line_to_backbuffer(surface, 0, 0, 255, v3[0], v3[1], v1[0], v1[1]);
-    set_pixel(surface, v1[0], v1[1], 255, 255, 255);
-    set_pixel(surface, v2[0], v2[1], 255, 255, 255);
-    set_pixel(surface, v3[0], v3[1], 255, 255, 255);
+    uint32_t white = pack_pixel(get_pixel_packing(surface), 255, 255, 255);
+    set_pixel(surface, v1[0], v1[1], white);
+    set_pixel(surface, v2[0], v2[1], white);
+    set_pixel(surface, v3[0], v3[1], white);
     return;
   }
   draw_line_to_backbuffer(surface, r, g, b, v1[0], v1[1], v2[0], v2[1]);
@@ -348,6 +485,8 @@ void draw_wireframe_tri_to_backbuffer(SDL_Surface *surface, vec2i v1, vec2i v2,
 
 void draw_tri_to_backbuffer(SDL_Surface *surface, vec2i v1, vec2i v2, vec2i v3,
                             uint8_t r, uint8_t g, uint8_t b, int debug) {
+  pixel_packing packing = get_pixel_packing(surface);
+  uint32_t pixel = pack_pixel(packing, r, g, b);
   if (debug) {
     bbox2i bb = calculate_bbox2i_from_tri(v1, v2, v3);
     uint16_t sx = max(0, bb.min[0]), ex = min(surface->w - 1, bb.max[0]);
@@ -400,9 +539,9 @@ void draw_tri_to_backbuffer(SDL_Surface *surface, vec2i v1, vec2i v2, vec2i v3,
             uint8_t rc = (uint8_t)fmaxf(0.0f, fminf(255.0f, u * 255.0f));
             uint8_t gc = (uint8_t)fmaxf(0.0f, fminf(255.0f, v * 255.0f));
             uint8_t bc = (uint8_t)fmaxf(0.0f, fminf(255.0f, w * 255.0f));
-            set_pixel(surface, x, y, rc, gc, bc);
+            set_pixel(surface, x, y, pack_pixel(packing, rc, gc, bc));
           } else {
-            set_pixel(surface, x, y, r, g, b);
+            set_pixel(surface, x, y, pixel);
           }
         }
         e0 += step_x_e0;
@@ -436,56 +575,235 @@ void draw_tri_to_backbuffer(SDL_Surface *surface, vec2i v1, vec2i v2, vec2i v3,
           inv;
       float w = 1.0f - u - v;
       if (u >= -1e-6f && v >= -1e-6f && w >= -1e-6f)
-        set_pixel(surface, x, y, r, g, b);
+        set_pixel(surface, x, y, pixel);
     }
 }
 
-static void draw_tri_to_backbuffer_zbuffered(
-    SDL_Surface *surface, uint32_t *zbuffer, vec2i v1, vec2i v2, vec2i v3,
-    uint8_t r, uint8_t g, uint8_t b, float z1_over_w, float oow1,
-    float z2_over_w, float oow2, float z3_over_w, float oow3, vec3 normal,
-    void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
-                            vec3 normal)) {
+static int64_t floor_div(int64_t a, int64_t b) {
+  int64_t q = a / b;
+  return (a % b != 0 && a < 0) ? q - 1 : q;
+}
 
-  bbox2i bb = calculate_bbox2i_from_tri(v1, v2, v3);
-  uint16_t sx = max(0, bb.min[0]), ex = min(surface->w - 1, bb.max[0]);
-  uint16_t sy = max(0, bb.min[1]), ey = min(surface->h - 1, bb.max[1]);
+// Builds the integer edge equations of tri over its bounding box clipped to
+// clip and the surface. Edge i runs from vertex i + 1 to vertex i + 2 and is
+// evaluated exactly in 64 bits at the first pixel centre. Pixel centres are
+// a whole pixel apart, so moving one pixel changes an edge function by a
+// multiple of SUBPIXEL_ONE; dividing by SUBPIXEL_ONE (flooring) then leaves a
+// constant remainder per edge and lets the pixel loops step in 32 bits.
+// Samples exactly on an edge belong to the triangle only for top and left
+// edges, so a pixel on an edge shared by two triangles is drawn once.
+int setup_raster_tri(SDL_Surface *surface, const raster_tri *tri, bbox2i clip,
+                     raster_setup *setup) {
+  const int *v[3] = {tri->v[0], tri->v[1], tri->v[2]};
+
+  bbox2i bb = calculate_bbox2i_from_tri(v[0], v[1], v[2]);
+  bbox2i *bounds = &setup->bounds;
+  bounds->min[0] = max(max(0, clip.min[0]), bb.min[0] >> SUBPIXEL_BITS);
+  bounds->max[0] =
+      min(min(surface->w - 1, clip.max[0]), bb.max[0] >> SUBPIXEL_BITS);
+  bounds->min[1] = max(max(0, clip.min[1]), bb.min[1] >> SUBPIXEL_BITS);
+  bounds->max[1] =
+      min(min(surface->h - 1, clip.max[1]), bb.max[1] >> SUBPIXEL_BITS);
+  if (bounds->min[0] > bounds->max[0] || bounds->min[1] > bounds->max[1])
+    return 0;
+
+  int64_t area = (int64_t)(v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) -
+                 (int64_t)(v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+  if (area <= 0)
+    return 0;
+
+  int64_t px = ((int64_t)bounds->min[0] << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+  int64_t py = ((int64_t)bounds->min[1] << SUBPIXEL_BITS) + SUBPIXEL_ONE / 2;
+  float inv_area = 1.0f / (float)area;
+  setup->scale = (float)SUBPIXEL_ONE * inv_area;
+
+  for (int i = 0; i < 3; ++i) {
+    const int *a = v[(i + 1) % 3], *b = v[(i + 2) % 3];
+    int dx = b[0] - a[0];
+    int dy = b[1] - a[1];
+    int top_left = dy < 0 || (dy == 0 && dx > 0);
+
+    int64_t e = (int64_t)dx * (py - a[1]) - (int64_t)dy * (px - a[0]);
+    if (!top_left)
+      e -= 1;
+
+    int64_t q = floor_div(e, SUBPIXEL_ONE);
+    setup->e[i] = (int32_t)q;
+    setup->step_x[i] = -dy;
+    setup->step_y[i] = dx;
+    setup->offset[i] = (float)(e - q * SUBPIXEL_ONE) * inv_area;
+  }
+  return 1;
+}
 
-  float det =
-      (v2[1] - v3[1]) * (v1[0] - v3[0]) + (v3[0] - v2[0]) * (v1[1] - v3[1]);
-  if (fabsf(det) < 1e-8f)
-    return;
-  float inv = 1.0f / det;
+static void setup_varying_plane(const float a[3], const float bary[3],
+                                const float bary_x[3], const float bary_y[3],
+                                varying_setup *vs, uint32_t k) {
+  vs->value[k] = vs->step_x[k] = vs->step_y[k] = 0.0f;
+  for (int i = 0; i < 3; ++i) {
+    vs->value[k] += a[i] * bary[i];
+    vs->step_x[k] += a[i] * bary_x[i];
+    vs->step_y[k] += a[i] * bary_y[i];
+  }
+}
 
-  for (uint16_t y = sy; y <= ey; ++y)
-    for (uint16_t x = sx; x <= ex; ++x) {
-      float px = (float)x + 0.5f;
-      float py = (float)y + 0.5f;
-      float u =
-          ((v2[1] - v3[1]) * (px - v3[0]) + (v3[0] - v2[0]) * (py - v3[1])) *
-          inv;
-      float v =
-          ((v3[1] - v1[1]) * (px - v3[0]) + (v1[0] - v3[0]) * (py - v3[1])) *
-          inv;
-      float w = 1.0f - u - v;
+// Each varying over w is the barycentric blend of its vertex values, and the
+// barycentrics are affine in the edge functions, so the blend is a plane
+// whose per-pixel steps follow from the edges' integer steps. The plane is
+// anchored at the corner of tri's unclipped bounding box rather than at the
+// clipped bounds the kernel walks, so a pixel gets the same value whichever
+// tile or run of blocks it is rasterized in.
+void setup_varyings(const raster_tri *tri, varying_setup *vs) {
+  const int *v[3] = {tri->v[0], tri->v[1], tri->v[2]};
+  bbox2i bb = calculate_bbox2i_from_tri(v[0], v[1], v[2]);
+  vs->count = tri->varying_count;
+  vs->origin[0] = bb.min[0] >> SUBPIXEL_BITS;
+  vs->origin[1] = bb.min[1] >> SUBPIXEL_BITS;
+
+  int64_t area = (int64_t)(v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) -
+                 (int64_t)(v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+  float inv_area = area ? 1.0f / (float)area : 0.0f;
+  int64_t px = (int64_t)vs->origin[0] * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+  int64_t py = (int64_t)vs->origin[1] * SUBPIXEL_ONE + SUBPIXEL_ONE / 2;
+  float bary[3], bary_x[3], bary_y[3];
+  for (int i = 0; i < 3; ++i) {
+    const int *a = v[(i + 1) % 3], *b = v[(i + 2) % 3];
+    int64_t dx = b[0] - a[0], dy = b[1] - a[1];
+    bary[i] = (float)(dx * (py - a[1]) - dy * (px - a[0])) * inv_area;
+    bary_x[i] = (float)(-dy * SUBPIXEL_ONE) * inv_area;
+    bary_y[i] = (float)(dx * SUBPIXEL_ONE) * inv_area;
+  }
 
-      if (u >= -1e-6f && v >= -1e-6f && w >= -1e-6f) {
-        float interp_oow = u * oow1 + v * oow2 + w * oow3;
-        if (interp_oow <= 1e-8f)
-          continue;
+  for (uint32_t k = 0; k < vs->count; ++k) {
+    float a[3] = {tri->varyings[0][k], tri->varyings[1][k],
+                  tri->varyings[2][k]};
+    setup_varying_plane(a, bary, bary_x, bary_y, vs, k);
+  }
+  setup_varying_plane(tri->oow, bary, bary_x, bary_y, vs, MAX_VARYINGS);
+}
 
-        vec4 IN = {r, g, b, 255.0f};
-        vec4 FINAL_RGB;
-        fragment_shader(FINAL_RGB, IN, (vec2){u, v}, (vec3){u, v, w}, normal);
+void init_fragment_batch(fragment_batch *batch, const raster_tri *tri) {
+  batch->mask = 0;
+  batch->in[0] = tri->r;
+  batch->in[1] = tri->g;
+  batch->in[2] = tri->b;
+  batch->in[3] = 255.0f;
+  batch->normal[0] = tri->normal[0];
+  batch->normal[1] = tri->normal[1];
+  batch->normal[2] = tri->normal[2];
+  batch->texture = tri->texture;
+}
 
-        FINAL_RGB[0] *= FINAL_RGB[3] / 255;
-        FINAL_RGB[1] *= FINAL_RGB[3] / 255;
-        FINAL_RGB[2] *= FINAL_RGB[3] / 255;
+// Shades the lanes set in batch->mask with the triangle's batched shader in
+// one call, or with its per-fragment shader one lane at a time.
+void shade_fragment_batch(const raster_tri *tri, fragment_batch *batch) {
+  if (tri->fragment_batch) {
+    tri->fragment_batch(batch);
+    return;
+  }
+  for (int l = 0; l < FRAGMENT_BATCH_SIZE; ++l) {
+    if (!(batch->mask & (1u << l)))
+      continue;
+    vec4 OUT;
+    tri->fragment_shader(
+        OUT, batch->in, (vec2){batch->uv[0][l], batch->uv[1][l]},
+        (vec3){batch->position[0][l], batch->position[1][l],
+               batch->position[2][l]},
+        batch->normal);
+    for (int c = 0; c < 4; ++c)
+      batch->out[c][l] = OUT[c];
+  }
+}
 
-        float z = u * z1_over_w + v * z2_over_w + w * z3_over_w;
-        set_pixel_zbuffered(surface, zbuffer, x, y, FINAL_RGB[0], FINAL_RGB[1], FINAL_RGB[2], z);
-      }
+static uint32_t rasterize_tri_zbuffered_scalar(SDL_Surface *surface,
+                                               void *zbuffer,
+                                               const raster_tri *tri,
+                                               bbox2i clip) {
+  return raster_kernel_scalar(surface, zbuffer, tri, clip, NULL,
+                              tri->depth_format, tri->late_depth);
+}
+
+static raster_kernel_fn raster_kernel = NULL;
+static int raster_kernel_id = RASTER_KERNEL_SCALAR;
+
+#define RASTER_MAX_VARIANTS 64
+
+static raster_variant raster_variants[RASTER_MAX_VARIANTS];
+static uint32_t raster_variant_count = 0;
+
+// Picks the pixel loop used by rasterize_tri_zbuffered(). RASTER_KERNEL_AUTO
+// takes the widest one the CPU reports; a kernel the CPU or build lacks falls
+// back to the next narrower one. Returns the kernel actually selected. Call
+// from the main thread before any tile workers rasterize.
+int select_raster_kernel(int kernel) {
+#ifdef RASTER_X86_KERNELS
+  if ((kernel == RASTER_KERNEL_AUTO || kernel == RASTER_KERNEL_AVX2) &&
+      SDL_HasAVX2()) {
+    raster_kernel = rasterize_tri_zbuffered_avx2;
+    raster_kernel_id = RASTER_KERNEL_AVX2;
+    return RASTER_KERNEL_AVX2;
+  }
+  if (kernel != RASTER_KERNEL_SCALAR && SDL_HasSSE41()) {
+    raster_kernel = rasterize_tri_zbuffered_sse41;
+    raster_kernel_id = RASTER_KERNEL_SSE41;
+    return RASTER_KERNEL_SSE41;
+  }
+#else
+  (void)kernel;
+#endif
+  raster_kernel = rasterize_tri_zbuffered_scalar;
+  raster_kernel_id = RASTER_KERNEL_SCALAR;
+  return RASTER_KERNEL_SCALAR;
+}
+
+static const raster_variant *lookup_raster_variant(fragment_batch_fn shader,
+                                                   int depth_format,
+                                                   int late_depth) {
+  for (uint32_t i = 0; i < raster_variant_count; i++) {
+    const raster_variant *v = &raster_variants[i];
+    if (v->shader == shader && v->depth_format == depth_format &&
+        (v->late_depth != 0) == (late_depth != 0))
+      return v;
+  }
+  return NULL;
+}
+
+// Adds specialized pixel loops to the table searched by
+// find_raster_variant(). Variants already registered for the same shader,
+// depth format and late depth setting are kept. Call from the main thread
+// before rendering.
+void register_raster_variants(const raster_variant *variants,
+                              uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    const raster_variant *v = &variants[i];
+    if (lookup_raster_variant(v->shader, v->depth_format, v->late_depth))
+      continue;
+    if (raster_variant_count == RASTER_MAX_VARIANTS) {
+      printf("Raster variant table full: register_raster_variants()\n");
+      return;
     }
+    raster_variants[raster_variant_count++] = *v;
+  }
+}
+
+// Meant to be called once per draw call, not per triangle.
+raster_kernel_fn find_raster_variant(fragment_batch_fn shader, int depth_format,
+                                     int late_depth) {
+  if (!raster_kernel)
+    select_raster_kernel(RASTER_KERNEL_AUTO);
+  const raster_variant *v =
+      lookup_raster_variant(shader, depth_format, late_depth);
+  return v ? v->kernels[raster_kernel_id] : NULL;
+}
+
+uint32_t rasterize_tri_zbuffered(SDL_Surface *surface, void *zbuffer,
+                                 const raster_tri *tri, bbox2i clip) {
+  if (!raster_kernel)
+    select_raster_kernel(RASTER_KERNEL_AUTO);
+  raster_kernel_fn kernel = tri->kernel ? tri->kernel : raster_kernel;
+  if (tri->hiz)
+    return rasterize_tri_hiz(tri->hiz, kernel, surface, zbuffer, tri, clip);
+  return kernel(surface, zbuffer, tri, clip);
 }
 
 void draw_tri3d_to_backbuffer(
@@ -496,17 +814,14 @@ void draw_tri3d_to_backbuffer(
     void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
                             vec3 normal)) {
 
-  mat4 model, view, proj, mv, mvp;
-  update_model_matrix(&model, pos, pivot, rot);
-  update_view_matrix(&view, c);
-  update_projection_matrix(&proj, c, surface->w, surface->h);
-  mat4_mul(mv, view, model);
-  mat4_mul(mvp, proj, mv);
+  draw_transform t;
+  setup_draw_transform(&t, &c, pos, rot, (vec3){1.0f, 1.0f, 1.0f}, pivot,
+                       surface->w, surface->h, DEPTH_UNORM32);
 
   vec4 clip1, clip2, clip3;
-  mat4_transform_clip(clip1, v1, mvp);
-  mat4_transform_clip(clip2, v2, mvp);
-  mat4_transform_clip(clip3, v3, mvp);
+  mat4_transform_clip(clip1, v1, t.mvp);
+  mat4_transform_clip(clip2, v2, t.mvp);
+  mat4_transform_clip(clip3, v3, t.mvp);
 
   vec3 normal;
   vec3 edge1, edge2;
@@ -529,13 +844,8 @@ void draw_tri3d_to_backbuffer(
   normal[1] /= l;
   normal[2] /= l;
 
-  mat4 model_inv;
-  mat4_inverse(model_inv, model);
-  mat4 normal_matrix;
-  mat4_transpose(normal_matrix, model_inv);
-
   vec3 normal_world;
-  mat4_vec3_mul_normal(normal_world, normal_matrix, normal);
+  mat4_vec3_mul_normal(normal_world, t.normal_matrix, normal);
 
   float normal_len = sqrtf(normal_world[0] * normal_world[0] +
                            normal_world[1] * normal_world[1] +
@@ -549,7 +859,7 @@ void draw_tri3d_to_backbuffer(
   if (clip1[3] <= 0 || clip2[3] <= 0 || clip3[3] <= 0)
     return;
 
-  clip_vertex input_verts[6], output_verts[6];
+  clip_vertex input_verts[CLIP_MAX_VERTS], output_verts[CLIP_MAX_VERTS];
   int count = 3;
   input_verts[0] =
       (clip_vertex){.p = {clip1[0], clip1[1], clip1[2]}, .w = clip1[3]};
@@ -558,26 +868,31 @@ void draw_tri3d_to_backbuffer(
   input_verts[2] =
       (clip_vertex){.p = {clip3[0], clip3[1], clip3[2]}, .w = clip3[3]};
 
-  clip_vertex temp[6];
+  clip_vertex temp[CLIP_MAX_VERTS];
   int temp_count;
 
-  clip_polygon_component(input_verts, count, output_verts, &temp_count, 0, 0);
+  clip_polygon_component(input_verts, count, output_verts, &temp_count, 0,
+                         CLIP_NEGATIVE, 1.0f, 0);
   if (temp_count < 3)
     return;
-  clip_polygon_component(output_verts, temp_count, temp, &count, 0, 1);
+  clip_polygon_component(output_verts, temp_count, temp, &count, 0,
+                         CLIP_POSITIVE, 1.0f, 0);
   if (count < 3)
     return;
-  clip_polygon_component(temp, count, output_verts, &temp_count, 1, 0);
+  clip_polygon_component(temp, count, output_verts, &temp_count, 1,
+                         CLIP_NEGATIVE, 1.0f, 0);
   if (temp_count < 3)
     return;
-  clip_polygon_component(output_verts, temp_count, temp, &count, 1, 1);
+  clip_polygon_component(output_verts, temp_count, temp, &count, 1,
+                         CLIP_POSITIVE, 1.0f, 0);
   if (count < 3)
     return;
-  clip_polygon_component(temp, count, output_verts, &temp_count, 2, 1);
+  clip_polygon_component(temp, count, output_verts, &temp_count, 2,
+                         CLIP_POSITIVE, 1.0f, 0);
   if (temp_count < 3)
     return;
 
-  clip_vertex verts[6];
+  clip_vertex verts[CLIP_MAX_VERTS];
   count = temp_count;
   for (int i = 0; i < count; ++i)
     verts[i] = output_verts[i];
@@ -593,7 +908,7 @@ void draw_tri3d_to_backbuffer(
     }
   }
 
-  vec2i screen[6];
+  vec2i screen[CLIP_MAX_VERTS];
   for (int i = 0; i < count; ++i) {
     float ndc_x = verts[i].p[0];
     float ndc_y = verts[i].p[1];
@@ -639,27 +954,31 @@ void draw_tri3d_to_backbuffer(
 }
 
 void draw_tri3d_to_backbuffer_zbuffered(
-    SDL_Surface *surface, uint32_t *zbuffer, camera c, vec3 v1, vec3 v2,
-    vec3 v3, uint8_t r, uint8_t g, uint8_t b, vec3 pos, vec3 rot, vec3 pivot,
-    int debug,
+    SDL_Surface *surface, void *zbuffer, int depth_format, camera c, vec3 v1,
+    vec3 v2, vec3 v3, uint8_t r, uint8_t g, uint8_t b, vec3 pos, vec3 rot,
+    vec3 pivot, int debug,
     void (*geometry_shader)(vec4 OUT, vec3 normal, vec2 uv, vec3 position,
                             vec3 light_dir, uint8_t r, uint8_t g, uint8_t b),
     void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
                             vec3 normal)) {
 
-  mat4 model, view, proj, mv, mvp;
-  update_model_matrix(&model, pos, pivot, rot);
-  update_view_matrix(&view, c);
-  update_projection_matrix(&proj, c, surface->w, surface->h);
-  mat4_mul(mv, view, model);
-  mat4_mul(mvp, proj, mv);
+  draw_transform t;
+  setup_draw_transform(&t, &c, pos, rot, (vec3){1.0f, 1.0f, 1.0f}, pivot,
+                       surface->w, surface->h, depth_format);
+  draw_tri3d_to_backbuffer_zbuffered_precomputed(
+      surface, zbuffer, depth_format, &t, v1, v2, v3, r, g, b, debug,
+      geometry_shader, fragment_shader);
+}
 
-  vec4 clip1, clip2, clip3;
-  mat4_transform_clip(clip1, v1, mvp);
-  mat4_transform_clip(clip2, v2, mvp);
-  mat4_transform_clip(clip3, v3, mvp);
+void transform_vertices(const draw_transform *t, const vec3 *in, vec4 *out,
+                        uint32_t count) {
+  for (uint32_t i = 0; i < count; ++i)
+    mat4_transform_clip(out[i], in[i], t->mvp);
+}
 
-  vec3 normal;
+// Unit normal of the triangle's plane, following its winding.
+void compute_face_normal(vec3 out, const vec3 v1, const vec3 v2,
+                         const vec3 v3) {
   vec3 edge1, edge2;
 
   edge1[0] = v2[0] - v1[0];
@@ -669,24 +988,119 @@ void draw_tri3d_to_backbuffer_zbuffered(
   edge2[1] = v3[1] - v1[1];
   edge2[2] = v3[2] - v1[2];
 
-  normal[0] = edge1[1] * edge2[2] - edge1[2] * edge2[1];
-  normal[1] = edge1[2] * edge2[0] - edge1[0] * edge2[2];
-  normal[2] = edge1[0] * edge2[1] - edge1[1] * edge2[0];
+  out[0] = edge1[1] * edge2[2] - edge1[2] * edge2[1];
+  out[1] = edge1[2] * edge2[0] - edge1[0] * edge2[2];
+  out[2] = edge1[0] * edge2[1] - edge1[1] * edge2[0];
 
-  float l = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] +
-                  normal[2] * normal[2]);
+  float l = sqrtf(out[0] * out[0] + out[1] * out[1] + out[2] * out[2]);
 
-  normal[0] /= l;
-  normal[1] /= l;
-  normal[2] /= l;
+  out[0] /= l;
+  out[1] /= l;
+  out[2] /= l;
+}
 
-  mat4 model_inv;
-  mat4_inverse(model_inv, model);
-  mat4 normal_matrix;
-  mat4_transpose(normal_matrix, model_inv);
+void compute_bounds3(bounds3 *b, const vec3 *points, uint32_t count) {
+  memset(b, 0, sizeof(*b));
+  if (count == 0)
+    return;
+
+  for (int k = 0; k < 3; ++k)
+    b->min[k] = b->max[k] = points[0][k];
+  for (uint32_t i = 1; i < count; ++i)
+    for (int k = 0; k < 3; ++k) {
+      b->min[k] = fminf(b->min[k], points[i][k]);
+      b->max[k] = fmaxf(b->max[k], points[i][k]);
+    }
+
+  for (int k = 0; k < 3; ++k)
+    b->center[k] = (b->min[k] + b->max[k]) * 0.5f;
+  float radius2 = 0.0f;
+  for (uint32_t i = 0; i < count; ++i) {
+    float dx = points[i][0] - b->center[0];
+    float dy = points[i][1] - b->center[1];
+    float dz = points[i][2] - b->center[2];
+    radius2 = fmaxf(radius2, dx * dx + dy * dy + dz * dz);
+  }
+  b->radius = sqrtf(radius2);
+}
+
+// Returns non-zero if the bounds lie wholly outside the view volume, or
+// project to less than CULL_MIN_SCREEN_RADIUS pixels. The six clip planes
+// -w <= x, y <= w and 0 <= z <= w are taken from the rows of the mvp, which
+// puts them in object space alongside the bounds. The sphere is tested first;
+// the box catches what the sphere's slack lets through.
+int cull_bounds3(const draw_transform *t, const bounds3 *b) {
+  const float(*m)[4] = t->mvp;
+  float planes[6][4];
+  for (int c = 0; c < 4; ++c) {
+    planes[0][c] = m[c][3] + m[c][0];
+    planes[1][c] = m[c][3] - m[c][0];
+    planes[2][c] = m[c][3] + m[c][1];
+    planes[3][c] = m[c][3] - m[c][1];
+    planes[4][c] = m[c][2];
+    planes[5][c] = m[c][3] - m[c][2];
+  }
+
+  for (int i = 0; i < 6; ++i) {
+    const float *p = planes[i];
+    float len = sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+    float dist =
+        p[0] * b->center[0] + p[1] * b->center[1] + p[2] * b->center[2] + p[3];
+    if (dist < -b->radius * len)
+      return 1;
+
+    // Farthest box corner along the plane normal.
+    float x = p[0] >= 0.0f ? b->max[0] : b->min[0];
+    float y = p[1] >= 0.0f ? b->max[1] : b->min[1];
+    float z = p[2] >= 0.0f ? b->max[2] : b->min[2];
+    if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0.0f)
+      return 1;
+  }
+
+  // Clip w is view depth. Measuring at the sphere's near side overestimates
+  // its projected size, so nothing visible is dropped. The model matrix
+  // stretches the sphere to at most max_scale times its radius.
+  float w = m[0][3] * b->center[0] + m[1][3] * b->center[1] +
+            m[2][3] * b->center[2] + m[3][3];
+  float radius = b->radius * t->max_scale;
+  float near_w = w - radius;
+  if (near_w > 0.0f &&
+      radius * t->pixel_scale < CULL_MIN_SCREEN_RADIUS * near_w)
+    return 1;
+  return 0;
+}
+
+void draw_tri3d_to_backbuffer_zbuffered_precomputed(
+    SDL_Surface *surface, void *zbuffer, int depth_format,
+    const draw_transform *t, vec3 v1, vec3 v2, vec3 v3, uint8_t r, uint8_t g,
+    uint8_t b, int debug,
+    geometry_shader_fn geometry_shader, fragment_shader_fn fragment_shader) {
+  vec4 clip1, clip2, clip3;
+  mat4_transform_clip(clip1, v1, t->mvp);
+  mat4_transform_clip(clip2, v2, t->mvp);
+  mat4_transform_clip(clip3, v3, t->mvp);
+
+  raster_target target = {
+      .surface = surface, .zbuffer = zbuffer, .depth_format = depth_format};
+  vec3 normal;
+  compute_face_normal(normal, v1, v2, v3);
+  draw_clip_tri_to_backbuffer_zbuffered(
+      &target, t, clip1, clip2, clip3, normal, NULL, r, g, b,
+      debug ? RENDER_WIREFRAME : 0, geometry_shader, fragment_shader, NULL);
+}
+
+void draw_clip_tri_to_backbuffer_zbuffered(
+    const raster_target *target, const draw_transform *t, const vec4 clip1,
+    const vec4 clip2, const vec4 clip3, const vec3 normal,
+    const float *varyings[3], uint8_t r, uint8_t g, uint8_t b, int flags,
+    geometry_shader_fn geometry_shader, fragment_shader_fn fragment_shader,
+    fragment_batch_fn fragment_batch) {
+  SDL_Surface *surface = target->surface;
+  int varying_count = varyings ? (int)target->varying_count : 0;
+  stats.triangles_submitted++;
 
   vec3 normal_world;
-  mat4_vec3_mul_normal(normal_world, normal_matrix, normal);
+  mat4_vec3_mul_normal(normal_world, t->normal_matrix, (float *)normal);
 
   float normal_len = sqrtf(normal_world[0] * normal_world[0] +
                            normal_world[1] * normal_world[1] +
@@ -697,44 +1111,31 @@ void draw_tri3d_to_backbuffer_zbuffered(
     normal_world[2] /= normal_len;
   }
 
-  if (clip1[3] <= 0 && clip2[3] <= 0 && clip3[3] <= 0)
+  uint8_t code1 = clip_outcode(clip1, t->guard_x, t->guard_y);
+  uint8_t code2 = clip_outcode(clip2, t->guard_x, t->guard_y);
+  uint8_t code3 = clip_outcode(clip3, t->guard_x, t->guard_y);
+  if (code1 & code2 & code3 & OUTCODE_REJECT)
     return;
 
-  clip_vertex input_verts[6], output_verts[6];
+  clip_vertex verts[CLIP_MAX_VERTS];
   int count = 3;
-  input_verts[0] =
-      (clip_vertex){.p = {clip1[0], clip1[1], clip1[2]}, .w = clip1[3]};
-  input_verts[1] =
-      (clip_vertex){.p = {clip2[0], clip2[1], clip2[2]}, .w = clip2[3]};
-  input_verts[2] =
-      (clip_vertex){.p = {clip3[0], clip3[1], clip3[2]}, .w = clip3[3]};
-
-  clip_vertex temp[6];
-  int temp_count;
-
-  clip_polygon_component(input_verts, count, output_verts, &temp_count, 0, 0);
-  if (temp_count < 3)
-    return;
-  clip_polygon_component(output_verts, temp_count, temp, &count, 0, 1);
-  if (count < 3)
-    return;
-  clip_polygon_component(temp, count, output_verts, &temp_count, 1, 0);
-  if (temp_count < 3)
-    return;
-  clip_polygon_component(output_verts, temp_count, temp, &count, 1, 1);
-  if (count < 3)
-    return;
-  clip_polygon_component(temp, count, output_verts, &temp_count, 2, 1);
-  if (temp_count < 3)
-    return;
-
-  clip_vertex verts[6];
-  count = temp_count;
-  for (int i = 0; i < count; ++i)
-    verts[i] = output_verts[i];
+  verts[0] = (clip_vertex){.p = {clip1[0], clip1[1], clip1[2]}, .w = clip1[3]};
+  verts[1] = (clip_vertex){.p = {clip2[0], clip2[1], clip2[2]}, .w = clip2[3]};
+  verts[2] = (clip_vertex){.p = {clip3[0], clip3[1], clip3[2]}, .w = clip3[3]};
+  for (int i = 0; i < 3; ++i)
+    for (int k = 0; k < varying_count; ++k)
+      verts[i].varyings[k] = varyings[i][k];
+
+  uint8_t crossed = (code1 | code2 | code3) & OUTCODE_CLIP;
+  if (crossed) {
+    count = clip_polygon_outcodes(verts, count, crossed, t->guard_x,
+                                  t->guard_y, varying_count);
+    if (count < 3)
+      return;
+  }
 
-  float oow[6];
-  float z_over_w[6];
+  float oow[CLIP_MAX_VERTS];
+  float z_over_w[CLIP_MAX_VERTS];
   for (int i = 0; i < count; ++i) {
     float w = verts[i].w;
     if (w > 0.0001f) {
@@ -743,14 +1144,25 @@ void draw_tri3d_to_backbuffer_zbuffered(
       verts[i].p[0] *= oow[i];
       verts[i].p[1] *= oow[i];
       verts[i].p[2] *= oow[i];
+      for (int k = 0; k < varying_count; ++k)
+        verts[i].varyings[k] *= oow[i];
     } else {
       oow[i] = 0.0f;
       z_over_w[i] = 0.0f;
       verts[i].p[0] = verts[i].p[1] = verts[i].p[2] = 0.0f;
+      for (int k = 0; k < varying_count; ++k)
+        verts[i].varyings[k] = 0.0f;
     }
   }
 
-  vec2i screen[6];
+  // Screen positions are snapped to 1/SUBPIXEL_ONE of a pixel rather than
+  // truncated to whole pixels, so edges shared between triangles stay
+  // watertight and slow motion does not make geometry jump a pixel at a time.
+  int guard_min_x = (surface->w - RASTER_MAX_SPAN) * SUBPIXEL_ONE / 2;
+  int guard_max_x = (surface->w + RASTER_MAX_SPAN) * SUBPIXEL_ONE / 2;
+  int guard_min_y = (surface->h - RASTER_MAX_SPAN) * SUBPIXEL_ONE / 2;
+  int guard_max_y = (surface->h + RASTER_MAX_SPAN) * SUBPIXEL_ONE / 2;
+  vec2i screen[CLIP_MAX_VERTS];
   for (int i = 0; i < count; ++i) {
     float ndc_x = verts[i].p[0];
     float ndc_y = verts[i].p[1];
@@ -758,22 +1170,21 @@ void draw_tri3d_to_backbuffer_zbuffered(
     float x = (ndc_x * 0.5f + 0.5f) * surface->w;
     float y = (1.0f - (ndc_y * 0.5f + 0.5f)) * surface->h;
 
-    int ix = (int)x;
-    int iy = (int)y;
-
-    ix = ix < 0 ? 0 : (ix >= surface->w ? surface->w - 1 : ix);
-    iy = iy < 0 ? 0 : (iy >= surface->h ? surface->h - 1 : iy);
+    int ix = (int)floorf(x * SUBPIXEL_ONE + 0.5f);
+    int iy = (int)floorf(y * SUBPIXEL_ONE + 0.5f);
 
-    screen[i][0] = ix;
-    screen[i][1] = iy;
+    // Clipping already keeps vertices inside the guard band; this only
+    // absorbs rounding at its edges.
+    screen[i][0] = max(guard_min_x, min(guard_max_x, ix));
+    screen[i][1] = max(guard_min_y, min(guard_max_y, iy));
   }
 
   for (int i = 1; i < count - 1; ++i) {
-    int ax = screen[i][0] - screen[0][0];
-    int ay = screen[i][1] - screen[0][1];
-    int bx = screen[i + 1][0] - screen[0][0];
-    int by = screen[i + 1][1] - screen[0][1];
-    int area2 = ax * by - ay * bx;
+    int64_t ax = screen[i][0] - screen[0][0];
+    int64_t ay = screen[i][1] - screen[0][1];
+    int64_t bx = screen[i + 1][0] - screen[0][0];
+    int64_t by = screen[i + 1][1] - screen[0][1];
+    int64_t area2 = ax * by - ay * bx;
     if (area2 <= 0)
       continue;
 
@@ -786,13 +1197,54 @@ void draw_tri3d_to_backbuffer_zbuffered(
     FINAL_RGB[1] *= FINAL_RGB[3] / 255;
     FINAL_RGB[2] *= FINAL_RGB[3] / 255;
 
-    if (debug)
-      draw_wireframe_tri_to_backbuffer(surface, screen[0], screen[i],
-                                       screen[i + 1], r, g, b, 1);
-    else
-      draw_tri_to_backbuffer_zbuffered(
-          surface, zbuffer, screen[0], screen[i], screen[i + 1], FINAL_RGB[0],
-          FINAL_RGB[1], FINAL_RGB[2], z_over_w[0], oow[0], z_over_w[i], oow[i],
-          z_over_w[i + 1], oow[i + 1], normal_world, fragment_shader);
+    stats.triangles_rasterized++;
+    if (flags & RENDER_WIREFRAME) {
+      if (target->binner)
+        flush_tile_binner(target->binner);
+      // Lines are drawn with 16-bit coordinates, so guard band vertices are
+      // pulled back onto the surface edge.
+      vec2i p[3];
+      const int *corner[3] = {screen[0], screen[i], screen[i + 1]};
+      for (int k = 0; k < 3; ++k) {
+        p[k][0] = max(0, min(surface->w, corner[k][0] >> SUBPIXEL_BITS));
+        p[k][1] = max(0, min(surface->h, corner[k][1] >> SUBPIXEL_BITS));
+      }
+      draw_wireframe_tri_to_backbuffer(surface, p[0], p[1], p[2], r, g, b, 1);
+      continue;
+    }
+
+    raster_tri tri = {
+        .v = {{screen[0][0], screen[0][1]},
+              {screen[i][0], screen[i][1]},
+              {screen[i + 1][0], screen[i + 1][1]}},
+        .z_over_w = {z_over_w[0], z_over_w[i], z_over_w[i + 1]},
+        .oow = {oow[0], oow[i], oow[i + 1]},
+        .normal = {normal_world[0], normal_world[1], normal_world[2]},
+        .r = FINAL_RGB[0],
+        .g = FINAL_RGB[1],
+        .b = FINAL_RGB[2],
+        .late_depth = (flags & RENDER_LATE_DEPTH) != 0,
+        .depth_format = target->depth_format,
+        .varying_count = (uint8_t)varying_count,
+        .fragment_shader = fragment_shader,
+        .fragment_batch = fragment_batch,
+        .kernel = target->kernel,
+        .hiz = target->hiz,
+        .texture = target->texture,
+    };
+    const int corner[3] = {0, i, i + 1};
+    for (int j = 0; j < 3; ++j)
+      memcpy(tri.varyings[j], verts[corner[j]].varyings,
+             varying_count * sizeof(float));
+
+    if (target->binner && bin_raster_tri(target->binner, &tri))
+      continue;
+    // Without room in the bins the triangle is drawn now, after everything
+    // binned before it.
+    if (target->binner)
+      flush_tile_binner(target->binner);
+    stats.pixels_shaded += rasterize_tri_zbuffered(
+        surface, target->zbuffer, &tri,
+        (bbox2i){.min = {0, 0}, .max = {surface->w - 1, surface->h - 1}});
   }
 }
@@ -2,6 +2,7 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 typedef float vec2[2];
 typedef float vec3[3];
@@ -25,21 +26,286 @@ typedef struct {
   vec2i max;
 } bbox2i;
 
+// Most floats of per-vertex data a vertex shader may hand on to the
+// fragment shader.
+#define MAX_VARYINGS 8
+
+// A clip-space vertex with its varyings, which clipping interpolates
+// linearly in clip space like the position.
 typedef struct {
   vec3 p;
   float w;
+  float varyings[MAX_VARYINGS];
 } clip_vertex;
 
+// Object-space bounding volumes of a mesh: an axis-aligned box and a sphere
+// around the box centre enclosing every vertex.
+typedef struct {
+  vec3 min;
+  vec3 max;
+  vec3 center;
+  float radius;
+} bounds3;
+
+typedef void (*geometry_shader_fn)(vec4 OUT, vec3 normal, vec2 uv,
+                                   vec3 position, vec3 light_dir, uint8_t r,
+                                   uint8_t g, uint8_t b);
+typedef void (*fragment_shader_fn)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
+                                   vec3 normal);
+
+// Batched fragment shader interface: one call shades up to
+// FRAGMENT_BATCH_SIZE horizontally adjacent fragments of a triangle, laid
+// out as structure of arrays so a shader written as a plain loop over lanes
+// auto-vectorizes. Inputs match fragment_shader_fn: in and normal are the
+// triangle's flat colour and face normal, uv and position hold each lane's
+// arguments component by component. varyings holds each lane's
+// perspective-correct varyings when the draw has a vertex shader, and
+// ddx/ddy their screen-space derivatives at each lane, for picking texture
+// mip levels. texture is the draw's bound texture, if any,
+// see sample_texture_batch(). The shader writes RGBA to out for every lane
+// set in mask; other lanes may hold anything and it may write them too. In a
+// RENDER_LATE_DEPTH draw the shader may also clear bits of mask to discard
+// those lanes: they then write neither colour nor depth. Other draws ignore
+// changes to mask.
+#define FRAGMENT_BATCH_SIZE 8
+
+typedef struct texture texture;
+
+typedef struct {
+  uint32_t mask;
+  vec4 in;
+  vec3 normal;
+  const texture *texture;
+  _Alignas(32) float uv[2][FRAGMENT_BATCH_SIZE];
+  _Alignas(32) float position[3][FRAGMENT_BATCH_SIZE];
+  _Alignas(32) float out[4][FRAGMENT_BATCH_SIZE];
+  _Alignas(32) float varyings[MAX_VARYINGS][FRAGMENT_BATCH_SIZE];
+  _Alignas(32) float ddx[MAX_VARYINGS][FRAGMENT_BATCH_SIZE];
+  _Alignas(32) float ddy[MAX_VARYINGS][FRAGMENT_BATCH_SIZE];
+} fragment_batch;
+
+typedef void (*fragment_batch_fn)(fragment_batch *batch);
+
+// Per-draw matrices, built once per model per frame by setup_draw_transform()
+// and shared by every triangle of the draw. pixel_scale is the size in pixels
+// of one unit at a view depth of one; max_scale is the most model stretches
+// a length in object space. eye is the camera position in object space.
+// guard_x/guard_y are the half-extents of the guard band in NDC.
+typedef struct {
+  mat4 mvp;
+  mat4 model;
+  mat4 normal_matrix;
+  float pixel_scale;
+  float max_scale;
+  vec3 eye;
+  float guard_x;
+  float guard_y;
+} draw_transform;
+
+// The camera half of a draw_transform, which every draw seen by the camera
+// in a frame shares. setup_draw_transform() builds both halves;
+// setup_view_transform() and setup_model_transform() split the work so that
+// drawing many models only builds the view once.
+typedef struct {
+  mat4 view;
+  mat4 proj;
+  vec3 camera_position;
+  float pixel_scale;
+  float guard_x;
+  float guard_y;
+} view_transform;
+
+// Vertex stage: writes the varyings of one vertex to out from its object
+// space position, unit normal and texture coordinate. t gives the matrices
+// of the draw, e.g. t->model for a world space position.
+typedef void (*vertex_shader_fn)(float *out, const vec3 position,
+                                 const vec3 normal, const vec2 uv,
+                                 const draw_transform *t);
+
+// Packed layout of a 32-bit surface with 8-bit channels. Pixel loops build it
+// once per draw from the surface format and write packed values directly
+// rather than calling SDL_MapRGB() per pixel; pack_pixel() gives the same
+// value SDL_MapRGB() would for such formats (XRGB8888, ARGB8888, ...).
+typedef struct {
+  uint8_t r_shift, g_shift, b_shift;
+  uint32_t alpha;
+} pixel_packing;
+
+static inline pixel_packing get_pixel_packing(const SDL_Surface *s) {
+  pixel_packing p = {s->format->Rshift, s->format->Gshift, s->format->Bshift,
+                     s->format->Amask};
+  return p;
+}
+
+static inline uint32_t pack_pixel(pixel_packing p, uint8_t r, uint8_t g,
+                                  uint8_t b) {
+  return p.alpha | (uint32_t)r << p.r_shift | (uint32_t)g << p.g_shift |
+         (uint32_t)b << p.b_shift;
+}
+
+typedef struct tile_binner tile_binner;
+typedef struct raster_tri raster_tri;
+typedef struct hiz_buffer hiz_buffer;
+
+// Depth buffer formats. Each one encodes depth as an unsigned key where a
+// smaller key is nearer and all-ones is the cleared far value, so clears and
+// the less-than depth test work the same for every format.
+// DEPTH_UNORM32 and DEPTH_UNORM16 quantize [0, 1] depth to 32/16-bit fixed
+// point. DEPTH_FLOAT32 stores the float itself; non-negative float bit
+// patterns already sort like their values. DEPTH_FLOAT32_REVERSED projects
+// the near plane to 1 and the far plane to 0, which lines up float precision
+// with perspective's loss of precision in the distance, and stores the bits
+// subtracted from those of 1.0f so nearer is still smaller.
+#define DEPTH_UNORM32 0
+#define DEPTH_FLOAT32 1
+#define DEPTH_FLOAT32_REVERSED 2
+#define DEPTH_UNORM16 3
+#define DEPTH_FORMAT_COUNT 4
+
+static inline int depth_format_bytes(int format) {
+  return format == DEPTH_UNORM16 ? 2 : 4;
+}
+
+// Flags for draw_clip_tri_to_backbuffer_zbuffered() and render_model().
+// Depth is normally tested before the fragment shader runs, so occluded
+// pixels are never shaded. RENDER_LATE_DEPTH runs the shader for every
+// covered pixel first and then tests depth only for the lanes it left in
+// fragment_batch mask, for shaders that discard fragments or must see
+// occluded ones. Shaders cannot write depth.
+#define RENDER_WIREFRAME 1
+#define RENDER_LATE_DEPTH 2
+
+typedef uint32_t (*raster_kernel_fn)(SDL_Surface *surface, void *zbuffer,
+                                     const raster_tri *tri, bbox2i clip);
+
+// Destination of the triangle setup stage. Screen-space triangles are
+// rasterized straight into surface/zbuffer, or deferred into the tile binner
+// when one is attached and rasterized on flush_tile_binner(). The zbuffer
+// holds depth_format values and has as many per row as the surface, so both
+// share one pixel index. kernel, if set, is a specialized pixel loop from
+// find_raster_variant() used instead of the generic one. varying_count is
+// the number of varyings each vertex of the draw carries. hiz, if set, is
+// the coarse depth kept alongside zbuffer, see rasterize_tri_hiz(). texture
+// is handed to the fragment shader in fragment_batch.
+typedef struct {
+  SDL_Surface *surface;
+  void *zbuffer;
+  int depth_format;
+  tile_binner *binner;
+  raster_kernel_fn kernel;
+  uint32_t varying_count;
+  hiz_buffer *hiz;
+  const texture *texture;
+} raster_target;
+
+// Screen positions handed to the rasterizer are fixed point with
+// SUBPIXEL_BITS fractional bits. Pixel centres sit at (x + 0.5, y + 0.5).
+// Edge values are kept in 32 bits inside the pixel loops, which holds while
+// every vertex lies within RASTER_MAX_SPAN pixels on a side: at most
+// RASTER_MAX_SPAN^2 * SUBPIXEL_ONE. Triangles are clipped to a guard band of
+// that size centred on the render target, which may be up to RASTER_MAX_DIM
+// pixels on a side.
+#define SUBPIXEL_BITS 8
+#define SUBPIXEL_ONE (1 << SUBPIXEL_BITS)
+#define RASTER_MAX_DIM 2048
+#define RASTER_MAX_SPAN 2816
+
+// A clipped, projected triangle with its shading inputs, as handed from setup
+// to the rasterizer. v holds fixed point screen positions wound clockwise as
+// seen on screen, i.e. with positive area when y points down. varyings holds
+// each vertex's varyings already multiplied by its oow, since those, unlike
+// the varyings themselves, vary linearly across the screen.
+struct raster_tri {
+  vec2i v[3];
+  float z_over_w[3];
+  float oow[3];
+  vec3 normal;
+  uint8_t r, g, b;
+  uint8_t late_depth;
+  uint8_t depth_format;
+  uint8_t varying_count;
+  float varyings[3][MAX_VARYINGS];
+  fragment_shader_fn fragment_shader;
+  fragment_batch_fn fragment_batch;
+  raster_kernel_fn kernel;
+  hiz_buffer *hiz;
+  const texture *texture;
+};
+
+// Integer edge equations of a raster_tri over one rectangle of pixels.
+// e[i] is edge i (opposite vertex i) at the centre of pixel bounds.min, and
+// moves by step_x[i]/step_y[i] per pixel. The values are the exact fixed
+// point edge functions divided by SUBPIXEL_ONE and floored, with the top-left
+// fill rule folded in, so a pixel is covered iff all three are >= 0. The
+// barycentric weight of vertex i is e[i] * scale + offset[i].
+typedef struct {
+  bbox2i bounds;
+  int32_t e[3];
+  int32_t step_x[3];
+  int32_t step_y[3];
+  float scale;
+  float offset[3];
+} raster_setup;
+
+// Screen-space planes of a raster_tri's varyings divided by w, for the first
+// count varyings and for 1/w itself in slot MAX_VARYINGS. value holds them
+// at the pixel origin and step_x/step_y their change per pixel; row holds
+// them at x = origin[0] on the row being walked, so the pixel loops evaluate
+// each plane with one multiply-add instead of re-weighting the three
+// vertices at every pixel.
+typedef struct {
+  uint32_t count;
+  int origin[2];
+  float value[MAX_VARYINGS + 1];
+  float step_x[MAX_VARYINGS + 1];
+  float step_y[MAX_VARYINGS + 1];
+  float row[MAX_VARYINGS + 1];
+} varying_setup;
+
+typedef struct {
+  uint64_t models_culled;
+  uint64_t triangles_culled;
+  uint64_t triangles_submitted;
+  uint64_t triangles_rasterized;
+  uint64_t pixels_shaded;
+} render_stats;
+
+// Bounds whose projected radius is below this many pixels are culled as too
+// small to cover a pixel centre reliably.
+#define CULL_MIN_SCREEN_RADIUS 0.5f
+
+// Models wind visible faces so their normal points away from the viewer.
+// Testing that in object space needs only the face normal and the eye, and
+// rejects back faces before they are clipped and projected. Faces seen
+// exactly edge-on are kept for the screen-space area test to decide.
+static inline int is_backface(const vec3 normal, const vec3 v,
+                              const vec3 eye) {
+  return normal[0] * (v[0] - eye[0]) + normal[1] * (v[1] - eye[1]) +
+             normal[2] * (v[2] - eye[2]) <
+         0.0f;
+}
+
 static inline void dot_float(float *out, float a, float b) { *out = a * b; }
 
 static inline void dot_vec3(float *out, vec3 a, vec3 b) {
   *out = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
 }
 
+void reset_render_stats(void);
+render_stats get_render_stats(void);
+void add_render_stats(const render_stats *delta);
+
 void update_view_matrix(mat4 *mat, camera c);
 void update_model_matrix(mat4 *mat, vec3 pos, vec3 pivot, vec3 rot);
 void update_projection_matrix(mat4 *mat, camera c, uint16_t width,
-                              uint16_t height);
+                              uint16_t height, int depth_format);
+void setup_view_transform(view_transform *v, const camera *c,
+                          uint16_t width, uint16_t height, int depth_format);
+void setup_model_transform(draw_transform *t, const view_transform *v,
+                           vec3 pos, vec3 rot, vec3 scale, vec3 pivot);
+void setup_draw_transform(draw_transform *t, const camera *c, vec3 pos,
+                          vec3 rot, vec3 scale, vec3 pivot, uint16_t width,
+                          uint16_t height, int depth_format);
 void draw_line_to_backbuffer(SDL_Surface *surface, uint8_t r, uint8_t g,
                              uint8_t b, uint16_t x1, uint16_t y1, uint16_t x2,
                              uint16_t y2);
@@ -56,10 +322,142 @@ void draw_tri3d_to_backbuffer(
     void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
                             vec3 normal));
 void draw_tri3d_to_backbuffer_zbuffered(
-    SDL_Surface *surface, uint32_t *zbuffer, camera c, vec3 v1, vec3 v2,
-    vec3 v3, uint8_t r, uint8_t g, uint8_t b, vec3 pos, vec3 rot, vec3 pivot,
-    int debug,
+    SDL_Surface *surface, void *zbuffer, int depth_format, camera c, vec3 v1,
+    vec3 v2, vec3 v3, uint8_t r, uint8_t g, uint8_t b, vec3 pos, vec3 rot,
+    vec3 pivot, int debug,
     void (*geometry_shader)(vec4 OUT, vec3 normal, vec2 uv, vec3 position,
                             vec3 light_dir, uint8_t r, uint8_t g, uint8_t b),
     void (*fragment_shader)(vec4 OUT, vec4 IN, vec2 uv, vec3 position,
                             vec3 normal));
+void draw_tri3d_to_backbuffer_zbuffered_precomputed(
+    SDL_Surface *surface, void *zbuffer, int depth_format,
+    const draw_transform *t, vec3 v1, vec3 v2, vec3 v3, uint8_t r, uint8_t g,
+    uint8_t b, int debug,
+    geometry_shader_fn geometry_shader, fragment_shader_fn fragment_shader);
+void transform_vertices(const draw_transform *t, const vec3 *in, vec4 *out,
+                        uint32_t count);
+void compute_face_normal(vec3 out, const vec3 v1, const vec3 v2,
+                         const vec3 v3);
+void compute_bounds3(bounds3 *b, const vec3 *points, uint32_t count);
+int cull_bounds3(const draw_transform *t, const bounds3 *b);
+void draw_clip_tri_to_backbuffer_zbuffered(
+    const raster_target *target, const draw_transform *t, const vec4 clip1,
+    const vec4 clip2, const vec4 clip3, const vec3 normal,
+    const float *varyings[3], uint8_t r, uint8_t g, uint8_t b, int flags,
+    geometry_shader_fn geometry_shader, fragment_shader_fn fragment_shader,
+    fragment_batch_fn fragment_batch);
+uint32_t rasterize_tri_zbuffered(SDL_Surface *surface, void *zbuffer,
+                                 const raster_tri *tri, bbox2i clip);
+int setup_raster_tri(SDL_Surface *surface, const raster_tri *tri, bbox2i clip,
+                     raster_setup *setup);
+void setup_varyings(const raster_tri *tri, varying_setup *vs);
+void init_fragment_batch(fragment_batch *batch, const raster_tri *tri);
+void shade_fragment_batch(const raster_tri *tri, fragment_batch *batch);
+
+#define RASTER_KERNEL_AUTO 0
+#define RASTER_KERNEL_SCALAR 1
+#define RASTER_KERNEL_SSE41 2
+#define RASTER_KERNEL_AVX2 3
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RASTER_X86_KERNELS
+uint32_t rasterize_tri_zbuffered_sse41(SDL_Surface *surface, void *zbuffer,
+                                       const raster_tri *tri, bbox2i clip);
+uint32_t rasterize_tri_zbuffered_avx2(SDL_Surface *surface, void *zbuffer,
+                                      const raster_tri *tri, bbox2i clip);
+#endif
+
+int select_raster_kernel(int kernel);
+
+#define RASTER_KERNEL_COUNT 4
+
+// Pixel loops specialized at build time for one batched fragment shader,
+// depth format and late depth setting, one per kernel, indexed by
+// RASTER_KERNEL_*; the AUTO slot is unused. Instances are generated with
+// DEFINE_RASTER_VARIANTS() from raster_template.h. find_raster_variant()
+// returns the instance for the kernel chosen by select_raster_kernel(), or
+// NULL when none was registered, in which case the generic loop is used.
+typedef struct {
+  fragment_batch_fn shader;
+  int depth_format;
+  int late_depth;
+  raster_kernel_fn kernels[RASTER_KERNEL_COUNT];
+} raster_variant;
+
+void register_raster_variants(const raster_variant *variants, uint32_t count);
+raster_kernel_fn find_raster_variant(fragment_batch_fn shader, int depth_format,
+                                     int late_depth);
+
+// Fill count values, or a rect of a buffer whose rows are pitch values apart.
+// Large fills use non-temporal stores where available.
+void fill_u32(uint32_t *dst, uint32_t value, size_t count);
+void fill_rect_u32(uint32_t *dst, int pitch, bbox2i rect, uint32_t value);
+void fill_rect_u16(uint16_t *dst, int pitch, bbox2i rect, uint16_t value);
+
+// Coarse depth over HIZ_BLOCK x HIZ_BLOCK blocks of the zbuffer. Each block
+// keeps a depth key no nearer than any key stored in it, so a triangle whose
+// nearest depth is not nearer than that key cannot pass the depth test
+// anywhere in the block. Depth writes only move keys nearer, so the bound
+// stays valid without being updated; it is tightened when a triangle covers
+// a whole block, and reset to far with the zbuffer by clear_hiz_buffer().
+#define HIZ_BLOCK_BITS 3
+#define HIZ_BLOCK (1 << HIZ_BLOCK_BITS)
+
+hiz_buffer *allocate_hiz_buffer(uint16_t width, uint16_t height);
+void deallocate_hiz_buffer(hiz_buffer *hiz);
+void clear_hiz_buffer(hiz_buffer *hiz, bbox2i rect);
+uint32_t rasterize_tri_hiz(hiz_buffer *hiz, raster_kernel_fn kernel,
+                           SDL_Surface *surface, void *zbuffer,
+                           const raster_tri *tri, bbox2i clip);
+
+// A multiple of HIZ_BLOCK, so each coarse depth block lies in one tile.
+#define TILE_SIZE 32
+
+tile_binner *allocate_tile_binner(SDL_Surface *surface, void *zbuffer,
+                                  int depth_format, hiz_buffer *hiz,
+                                  uint16_t thread_count);
+void deallocate_tile_binner(tile_binner *binner);
+int bin_raster_tri(tile_binner *binner, const raster_tri *tri);
+void flush_tile_binner(tile_binner *binner);
+void clear_tile_binner(tile_binner *binner, uint32_t pixel);
+void resolve_tile_binner_depth(tile_binner *binner);
+
+// RGBA8 textures with a full mip chain. Each level is stored in
+// TEXTURE_TILE x TEXTURE_TILE tiles of texels, one cache line per tile, so
+// the texels a bilinear footprint or a short run of neighbouring pixels reads
+// share a line or two instead of touching one line per texel row. A texel
+// packs R in the low byte through A in the high one.
+#define TEXTURE_TILE_BITS 2
+#define TEXTURE_TILE (1 << TEXTURE_TILE_BITS)
+#define TEXTURE_MAX_LEVELS 17
+
+#define TEXTURE_FILTER_NEAREST 0
+#define TEXTURE_FILTER_BILINEAR 1
+
+// offset is the index of the level's first texel in texture.texels.
+typedef struct {
+  uint16_t width;
+  uint16_t height;
+  uint16_t tiles_x;
+  uint32_t offset;
+} texture_level;
+
+struct texture {
+  uint32_t *texels;
+  uint8_t level_count;
+  texture_level levels[TEXTURE_MAX_LEVELS];
+};
+
+texture *create_texture(uint16_t width, uint16_t height, const uint8_t *data,
+                        int channels);
+texture *load_texture(const char *path);
+texture *load_texture_raw(const char *path, uint16_t width, uint16_t height,
+                          int channels);
+void deallocate_texture(texture *t);
+float texture_lod(const texture *t, float dudx, float dvdx, float dudy,
+                  float dvdy);
+void sample_texture(const texture *t, int filter, float u, float v, float lod,
+                    vec4 out);
+void sample_texture_batch(const texture *t, int filter,
+                          const fragment_batch *batch, int u,
+                          float out[4][FRAGMENT_BATCH_SIZE]);
@@ -0,0 +1,207 @@
+#include "graphics.h"
+#include "raster_template.h"
+
+#define VARIFYHEAP(ptr, str, type)                                             \
+  do {                                                                         \
+    if (!(ptr)) {                                                              \
+      printf("Heap allocation error: %s\n", str);                              \
+      return type;                                                             \
+    }                                                                          \
+  } while (0)
+
+// Pixel depths are barycentric blends of the vertex depths, so they lie
+// between the nearest and farthest vertex up to float rounding, which this
+// margin absorbs.
+#define HIZ_DEPTH_MARGIN 1e-6f
+
+struct hiz_buffer {
+  uint32_t *max_key;
+  uint16_t blocks_x;
+  uint16_t blocks_y;
+};
+
+hiz_buffer *allocate_hiz_buffer(uint16_t width, uint16_t height) {
+  hiz_buffer *hiz = (hiz_buffer *)calloc(1, sizeof(hiz_buffer));
+  VARIFYHEAP(hiz, "allocate_hiz_buffer()", NULL);
+
+  hiz->blocks_x = (width + HIZ_BLOCK - 1) >> HIZ_BLOCK_BITS;
+  hiz->blocks_y = (height + HIZ_BLOCK - 1) >> HIZ_BLOCK_BITS;
+  size_t count = (size_t)hiz->blocks_x * hiz->blocks_y;
+  hiz->max_key = (uint32_t *)malloc(count * sizeof(uint32_t));
+  if (!hiz->max_key) {
+    printf("Heap allocation error: %s\n", "allocate_hiz_buffer()");
+    free(hiz);
+    return NULL;
+  }
+  fill_u32(hiz->max_key, 0xFFFFFFFF, count);
+  return hiz;
+}
+
+void deallocate_hiz_buffer(hiz_buffer *hiz) {
+  VARIFYHEAP(hiz, "deallocate_hiz_buffer()", );
+  free(hiz->max_key);
+  free(hiz);
+}
+
+// Resets the blocks overlapping rect, in pixels, to the far value. Call
+// whenever that part of the zbuffer is cleared. Blocks only partly inside
+// rect are reset too, which is merely less tight.
+void clear_hiz_buffer(hiz_buffer *hiz, bbox2i rect) {
+  bbox2i blocks = {{rect.min[0] >> HIZ_BLOCK_BITS,
+                    rect.min[1] >> HIZ_BLOCK_BITS},
+                   {rect.max[0] >> HIZ_BLOCK_BITS,
+                    rect.max[1] >> HIZ_BLOCK_BITS}};
+  fill_rect_u32(hiz->max_key, hiz->blocks_x, blocks, 0xFFFFFFFF);
+}
+
+// Keys of the nearest and farthest depth tri can write. Reversed Z encodes
+// larger depths as smaller keys, so the order is taken from the keys.
+static void tri_depth_keys(const raster_tri *tri, uint32_t *near_key,
+                           uint32_t *far_key) {
+  float z_min = tri->z_over_w[0], z_max = tri->z_over_w[0];
+  for (int i = 1; i < 3; i++) {
+    z_min = fminf(z_min, tri->z_over_w[i]);
+    z_max = fmaxf(z_max, tri->z_over_w[i]);
+  }
+  uint32_t a = encode_depth(tri->depth_format, z_min - HIZ_DEPTH_MARGIN);
+  uint32_t b = encode_depth(tri->depth_format, z_max + HIZ_DEPTH_MARGIN);
+  *near_key = a < b ? a : b;
+  *far_key = a < b ? b : a;
+}
+
+// Whether the pixel centre at (x, y), inside rs->bounds, is one the pixel
+// loops would cover.
+static int covers_pixel(const raster_setup *rs, const raster_tri *tri, int x,
+                        int y) {
+  int64_t dx = x - rs->bounds.min[0], dy = y - rs->bounds.min[1];
+  float oow = 0.0f;
+  for (int i = 0; i < 3; i++) {
+    int64_t e = rs->e[i] + dx * rs->step_x[i] + dy * rs->step_y[i];
+    if (e < 0)
+      return 0;
+    oow += tri->oow[i] * ((float)e * rs->scale + rs->offset[i]);
+  }
+  return oow > RASTER_OOW_EPS;
+}
+
+// Every pixel of a block tri covers ends up holding either tri's depth or a
+// nearer one that beat it, so once tri is drawn the block's bound can drop
+// to tri's farthest depth. Coverage is convex, so checking the corner pixels
+// of the block is enough.
+static void tighten_hiz(hiz_buffer *hiz, SDL_Surface *surface,
+                        const raster_tri *tri, bbox2i bounds,
+                        uint32_t far_key) {
+  raster_setup rs;
+  if (!setup_raster_tri(surface, tri, bounds, &rs))
+    return;
+
+  int bx0 = (rs.bounds.min[0] + HIZ_BLOCK - 1) >> HIZ_BLOCK_BITS;
+  int by0 = (rs.bounds.min[1] + HIZ_BLOCK - 1) >> HIZ_BLOCK_BITS;
+  int bx1 = rs.bounds.max[0] >> HIZ_BLOCK_BITS;
+  int by1 = rs.bounds.max[1] >> HIZ_BLOCK_BITS;
+  for (int by = by0; by <= by1; by++) {
+    int y0 = by << HIZ_BLOCK_BITS;
+    int y1 = y0 + HIZ_BLOCK - 1 < surface->h - 1 ? y0 + HIZ_BLOCK - 1
+                                                  : surface->h - 1;
+    if (y1 > rs.bounds.max[1])
+      break;
+    for (int bx = bx0; bx <= bx1; bx++) {
+      int x0 = bx << HIZ_BLOCK_BITS;
+      int x1 = x0 + HIZ_BLOCK - 1 < surface->w - 1 ? x0 + HIZ_BLOCK - 1
+                                                    : surface->w - 1;
+      if (x1 > rs.bounds.max[0])
+        break;
+      if (!covers_pixel(&rs, tri, x0, y0) || !covers_pixel(&rs, tri, x1, y0) ||
+          !covers_pixel(&rs, tri, x0, y1) || !covers_pixel(&rs, tri, x1, y1))
+        continue;
+      uint32_t *key = &hiz->max_key[by * hiz->blocks_x + bx];
+      if (far_key < *key)
+        *key = far_key;
+    }
+  }
+}
+
+// Rasterizes tri with kernel, skipping the blocks where coarse depth shows
+// it is hidden, and the whole triangle when it is hidden in all of them.
+// Visible blocks are handed to kernel in runs along each row of blocks, so
+// a mostly visible triangle costs one extra setup per row of blocks at most.
+// Triangles with late depth shade hidden fragments too and are never
+// skipped. Only blocks inside clip are read or written, so tiles sharing one
+// hiz_buffer can be rasterized on different threads.
+uint32_t rasterize_tri_hiz(hiz_buffer *hiz, raster_kernel_fn kernel,
+                           SDL_Surface *surface, void *zbuffer,
+                           const raster_tri *tri, bbox2i clip) {
+  int min_x = tri->v[0][0], max_x = tri->v[0][0];
+  int min_y = tri->v[0][1], max_y = tri->v[0][1];
+  for (int i = 1; i < 3; i++) {
+    min_x = tri->v[i][0] < min_x ? tri->v[i][0] : min_x;
+    max_x = tri->v[i][0] > max_x ? tri->v[i][0] : max_x;
+    min_y = tri->v[i][1] < min_y ? tri->v[i][1] : min_y;
+    max_y = tri->v[i][1] > max_y ? tri->v[i][1] : max_y;
+  }
+  bbox2i bounds = {{min_x >> SUBPIXEL_BITS, min_y >> SUBPIXEL_BITS},
+                   {max_x >> SUBPIXEL_BITS, max_y >> SUBPIXEL_BITS}};
+  for (int i = 0; i < 2; i++) {
+    int limit = (i == 0 ? surface->w : surface->h) - 1;
+    if (bounds.min[i] < clip.min[i])
+      bounds.min[i] = clip.min[i];
+    if (bounds.max[i] > clip.max[i])
+      bounds.max[i] = clip.max[i];
+    if (bounds.max[i] > limit)
+      bounds.max[i] = limit;
+    if (bounds.min[i] < 0)
+      bounds.min[i] = 0;
+  }
+  if (bounds.min[0] > bounds.max[0] || bounds.min[1] > bounds.max[1])
+    return 0;
+
+  uint32_t near_key, far_key;
+  tri_depth_keys(tri, &near_key, &far_key);
+
+  int bx0 = bounds.min[0] >> HIZ_BLOCK_BITS;
+  int by0 = bounds.min[1] >> HIZ_BLOCK_BITS;
+  int bx1 = bounds.max[0] >> HIZ_BLOCK_BITS;
+  int by1 = bounds.max[1] >> HIZ_BLOCK_BITS;
+
+  uint32_t hidden = 0;
+  if (!tri->late_depth)
+    for (int by = by0; by <= by1; by++)
+      for (int bx = bx0; bx <= bx1; bx++)
+        hidden += near_key >= hiz->max_key[by * hiz->blocks_x + bx];
+  if (hidden == (uint32_t)((bx1 - bx0 + 1) * (by1 - by0 + 1)))
+    return 0;
+
+  uint32_t shaded = 0;
+  if (hidden == 0) {
+    shaded = kernel(surface, zbuffer, tri, bounds);
+  } else {
+    for (int by = by0; by <= by1; by++) {
+      const uint32_t *row = &hiz->max_key[by * hiz->blocks_x];
+      int y0 = by << HIZ_BLOCK_BITS;
+      int y1 = y0 + HIZ_BLOCK - 1;
+      bbox2i run = {{0, y0 > bounds.min[1] ? y0 : bounds.min[1]},
+                    {0, y1 < bounds.max[1] ? y1 : bounds.max[1]}};
+      int start = -1;
+      for (int bx = bx0; bx <= bx1 + 1; bx++) {
+        int visible = bx <= bx1 && near_key < row[bx];
+        if (visible && start < 0)
+          start = bx;
+        if (visible || start < 0)
+          continue;
+        int x0 = start << HIZ_BLOCK_BITS;
+        int x1 = (bx << HIZ_BLOCK_BITS) - 1;
+        run.min[0] = x0 > bounds.min[0] ? x0 : bounds.min[0];
+        run.max[0] = x1 < bounds.max[0] ? x1 : bounds.max[0];
+        shaded += kernel(surface, zbuffer, tri, run);
+        start = -1;
+      }
+    }
+  }
+
+  // A triangle narrower than a block cannot cover one, and one that may
+  // discard pixels is not known to.
+  if (!tri->late_depth && bounds.max[0] - bounds.min[0] + 1 >= HIZ_BLOCK &&
+      bounds.max[1] - bounds.min[1] + 1 >= HIZ_BLOCK)
+    tighten_hiz(hiz, surface, tri, bounds, far_key);
+  return shaded;
+}
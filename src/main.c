@@ -1,15 +1,30 @@
 #include "game.h"
 
+// Imports an OBJ file once and writes it out as a binary mesh, which
+// init_model_mesh() then maps at startup without parsing.
+static int convert_mesh(const char *obj_path, const char *mesh_path) {
+  model m;
+  vec3 zero = {0.0f, 0.0f, 0.0f}, one = {1.0f, 1.0f, 1.0f};
+  if (!init_model_obj(&m, obj_path, zero, zero, one))
+    return 1;
+  int ok = write_model_mesh(&m, mesh_path);
+  deallocate_model(&m);
+  return ok ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
-  (void)argc;
-  (void)argv;
+  if (argc == 4 && strcmp(argv[1], "--convert-mesh") == 0)
+    return convert_mesh(argv[2], argv[3]);
 
   SDL_app *app =
       allocate_app(DEFAULT_BUFFER_WIDTH, DEFAULT_BUFFER_HEIGHT, "test build",
                    "main", update_graphics, update_game, init_game);
-  init_game();
+  set_display_thread_count(app->display, DISPLAY_THREADS_AUTO);
+  set_display_clear_mode(app->display, DISPLAY_CLEAR_DEFERRED);
+  set_display_depth_format(app->display, DEPTH_FLOAT32_REVERSED);
   update_app(app);
 
+  deallocate_game();
   deallocate_app(app);
   return 0;
 }
@@ -0,0 +1,521 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "display.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define VARIFYHEAP(ptr, str, type)                                             \
+  do {                                                                         \
+    if (!(ptr)) {                                                              \
+      printf("Heap allocation error: %s\n", str);                              \
+      return type;                                                             \
+    }                                                                          \
+  } while (0)
+
+// Binary mesh files hold a model's arrays exactly as model points at them,
+// so a mapped file is used in place. Each array starts on a
+// MESH_FILE_ALIGN boundary. Values are in the byte order of the machine
+// that wrote the file; byte_order tells a reader with the other order to
+// reject it rather than read garbage.
+#define MESH_FILE_MAGIC "SRMESH\0"
+#define MESH_FILE_VERSION 1
+#define MESH_FILE_BYTE_ORDER 0x01020304u
+#define MESH_FILE_ALIGN 64
+
+// Offsets are in bytes from the start of the file.
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t vertex_count;
+  uint32_t tri_count;
+  bounds3 bounds;
+  uint64_t vertices;
+  uint64_t normals;
+  uint64_t uvs;
+  uint64_t indices;
+  uint64_t face_normals;
+  uint64_t size;
+} mesh_file_header;
+
+struct mesh_mapping {
+  void *base;
+  size_t size;
+#ifdef _WIN32
+  HANDLE file;
+  HANDLE map;
+#endif
+};
+
+// Maps path copy-on-write: model's arrays are not const, and a page is only
+// copied if something writes to it.
+static mesh_mapping *map_mesh_file(const char *path) {
+  mesh_mapping *mapping = (mesh_mapping *)calloc(1, sizeof(mesh_mapping));
+  VARIFYHEAP(mapping, "map_mesh_file()", NULL);
+
+#ifdef _WIN32
+  mapping->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER size;
+  if (mapping->file != INVALID_HANDLE_VALUE &&
+      GetFileSizeEx(mapping->file, &size) && size.QuadPart > 0) {
+    mapping->size = (size_t)size.QuadPart;
+    mapping->map =
+        CreateFileMappingA(mapping->file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    if (mapping->map)
+      mapping->base = MapViewOfFile(mapping->map, FILE_MAP_COPY, 0, 0, 0);
+  }
+  if (!mapping->base) {
+    if (mapping->map)
+      CloseHandle(mapping->map);
+    if (mapping->file != INVALID_HANDLE_VALUE)
+      CloseHandle(mapping->file);
+  }
+#else
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    mapping->size = (size_t)st.st_size;
+    void *base = mmap(NULL, mapping->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    if (base != MAP_FAILED)
+      mapping->base = base;
+  }
+  // The mapping keeps the file referenced.
+  if (fd >= 0)
+    close(fd);
+#endif
+
+  if (!mapping->base) {
+    printf("Mesh error: cannot map %s\n", path);
+    free(mapping);
+    return NULL;
+  }
+  return mapping;
+}
+
+void unmap_mesh_file(mesh_mapping *mapping) {
+  VARIFYHEAP(mapping, "unmap_mesh_file()", );
+#ifdef _WIN32
+  UnmapViewOfFile(mapping->base);
+  CloseHandle(mapping->map);
+  CloseHandle(mapping->file);
+#else
+  munmap(mapping->base, mapping->size);
+#endif
+  free(mapping);
+}
+
+// Whether count elements of size bytes at offset lie inside the file and
+// start aligned.
+static int mesh_section_valid(const mesh_file_header *h, uint64_t offset,
+                              uint64_t count, size_t size) {
+  return offset % MESH_FILE_ALIGN == 0 && offset >= sizeof(*h) &&
+         offset <= h->size && count <= (h->size - offset) / size;
+}
+
+// Sets up model from a binary mesh file written by write_model_mesh(),
+// mapped and used in place: only the header is checked and nothing is
+// copied or parsed, so the cost does not grow with the mesh. Indices are
+// trusted to be in range. Returns 0, leaving model empty, on failure.
+int init_model_mesh(model *model, const char *path, vec3 position,
+                    vec3 rotation, vec3 scale) {
+  memset(model, 0, sizeof(*model));
+  mesh_mapping *mapping = map_mesh_file(path);
+  if (!mapping)
+    return 0;
+
+  const mesh_file_header *h = (const mesh_file_header *)mapping->base;
+  if (mapping->size < sizeof(*h) ||
+      memcmp(h->magic, MESH_FILE_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != MESH_FILE_VERSION ||
+      h->byte_order != MESH_FILE_BYTE_ORDER || h->size != mapping->size ||
+      h->tri_count > MAX_MODEL_TRIS ||
+      !mesh_section_valid(h, h->vertices, h->vertex_count, sizeof(vec3)) ||
+      !mesh_section_valid(h, h->normals, h->vertex_count, sizeof(vec3)) ||
+      !mesh_section_valid(h, h->uvs, h->vertex_count, sizeof(vec2)) ||
+      !mesh_section_valid(h, h->indices, (uint64_t)h->tri_count * 3,
+                          sizeof(uint32_t)) ||
+      !mesh_section_valid(h, h->face_normals, h->tri_count, sizeof(vec3))) {
+    printf("Mesh error: %s is not a version %d mesh file\n", path,
+           MESH_FILE_VERSION);
+    unmap_mesh_file(mapping);
+    return 0;
+  }
+
+  uint8_t *base = (uint8_t *)mapping->base;
+  model->mapping = mapping;
+  model->vertices = (vec3 *)(base + h->vertices);
+  model->normals = (vec3 *)(base + h->normals);
+  model->uvs = (vec2 *)(base + h->uvs);
+  model->indices = (uint32_t *)(base + h->indices);
+  model->face_normals = (vec3 *)(base + h->face_normals);
+  model->vertex_count = h->vertex_count;
+  model->tri_count = h->tri_count;
+  model->bounds = h->bounds;
+  memcpy(model->position, position, sizeof(vec3));
+  memcpy(model->rotation, rotation, sizeof(vec3));
+  memcpy(model->scale, scale, sizeof(vec3));
+  return allocate_model_caches(model);
+}
+
+static uint64_t align_mesh_offset(uint64_t offset) {
+  return (offset + MESH_FILE_ALIGN - 1) & ~(uint64_t)(MESH_FILE_ALIGN - 1);
+}
+
+static int write_mesh_section(FILE *f, uint64_t *at, uint64_t offset,
+                              const void *data, size_t len) {
+  static const uint8_t zeros[MESH_FILE_ALIGN] = {0};
+  if (fwrite(zeros, 1, (size_t)(offset - *at), f) != offset - *at ||
+      fwrite(data, 1, len, f) != len)
+    return 0;
+  *at = offset + len;
+  return 1;
+}
+
+// Writes model's mesh in the format init_model_mesh() maps. Returns 0 on
+// failure.
+int write_model_mesh(const model *model, const char *path) {
+  mesh_file_header h = {0};
+  memcpy(h.magic, MESH_FILE_MAGIC, sizeof(h.magic));
+  h.version = MESH_FILE_VERSION;
+  h.byte_order = MESH_FILE_BYTE_ORDER;
+  h.vertex_count = model->vertex_count;
+  h.tri_count = model->tri_count;
+  h.bounds = model->bounds;
+
+  size_t vertices_len = (size_t)model->vertex_count * sizeof(vec3);
+  size_t uvs_len = (size_t)model->vertex_count * sizeof(vec2);
+  size_t indices_len = (size_t)model->tri_count * 3 * sizeof(uint32_t);
+  size_t faces_len = (size_t)model->tri_count * sizeof(vec3);
+  h.vertices = align_mesh_offset(sizeof(h));
+  h.normals = align_mesh_offset(h.vertices + vertices_len);
+  h.uvs = align_mesh_offset(h.normals + vertices_len);
+  h.indices = align_mesh_offset(h.uvs + uvs_len);
+  h.face_normals = align_mesh_offset(h.indices + indices_len);
+  h.size = h.face_normals + faces_len;
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    printf("Mesh error: cannot write %s\n", path);
+    return 0;
+  }
+  uint64_t at = 0;
+  int ok = write_mesh_section(f, &at, 0, &h, sizeof(h)) &&
+           write_mesh_section(f, &at, h.vertices, model->vertices,
+                              vertices_len) &&
+           write_mesh_section(f, &at, h.normals, model->normals,
+                              vertices_len) &&
+           write_mesh_section(f, &at, h.uvs, model->uvs, uvs_len) &&
+           write_mesh_section(f, &at, h.indices, model->indices,
+                              indices_len) &&
+           write_mesh_section(f, &at, h.face_normals, model->face_normals,
+                              faces_len);
+  if (fclose(f) != 0)
+    ok = 0;
+  if (!ok)
+    printf("Mesh error: cannot write %s\n", path);
+  return ok;
+}
+
+// Growable array of elements of a fixed size.
+typedef struct {
+  void *data;
+  uint32_t count;
+  uint32_t capacity;
+} obj_array;
+
+static void *obj_push(obj_array *a, size_t size) {
+  if (a->count == a->capacity) {
+    uint32_t capacity = a->capacity ? a->capacity * 2 : 256;
+    void *data = realloc(a->data, capacity * size);
+    VARIFYHEAP(data, "init_model_obj()", NULL);
+    a->data = data;
+    a->capacity = capacity;
+  }
+  return (uint8_t *)a->data + (size_t)a->count++ * size;
+}
+
+// A face corner: 1-based position, texture coordinate and normal indices,
+// 0 where the corner has none.
+typedef struct {
+  uint32_t v, vt, vn;
+} obj_corner;
+
+typedef struct {
+  obj_array positions;
+  obj_array uvs;
+  obj_array normals;
+  obj_array corners;
+} obj_data;
+
+// Resolves an OBJ index, 1-based or negative from the end, against count
+// elements read so far. Returns 0 if it is out of range.
+static uint32_t resolve_obj_index(long index, uint32_t count) {
+  if (index > 0 && (unsigned long)index <= count)
+    return (uint32_t)index;
+  if (index < 0 && (unsigned long)-index <= count)
+    return count + 1 - (uint32_t)-index;
+  return 0;
+}
+
+// Parses "v", "v/vt", "v//vn" or "v/vt/vn" at *s.
+static int parse_obj_corner(const char **s, const obj_data *obj,
+                            obj_corner *c) {
+  char *end;
+  long v = strtol(*s, &end, 10), vt = 0, vn = 0;
+  if (end == *s)
+    return 0;
+  if (*end == '/') {
+    const char *p = end + 1;
+    if (*p != '/')
+      vt = strtol(p, &end, 10);
+    else
+      end = (char *)p;
+    if (*end == '/')
+      vn = strtol(end + 1, &end, 10);
+  }
+  *s = end;
+  c->v = resolve_obj_index(v, obj->positions.count);
+  c->vt = vt ? resolve_obj_index(vt, obj->uvs.count) : 0;
+  c->vn = vn ? resolve_obj_index(vn, obj->normals.count) : 0;
+  return c->v && (!vt || c->vt) && (!vn || c->vn);
+}
+
+static int parse_obj_floats(const char *s, float *out, int count) {
+  for (int i = 0; i < count; i++) {
+    char *end;
+    out[i] = strtof(s, &end);
+    if (end == s)
+      return i;
+    s = end;
+  }
+  return count;
+}
+
+// Reads one line of an OBJ file into obj. Polygons are split into fans of
+// triangles. Statements other than v, vt, vn and f are ignored.
+static int parse_obj_line(const char *s, obj_data *obj) {
+  while (*s == ' ' || *s == '\t')
+    s++;
+  float f[3];
+  if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+    if (parse_obj_floats(s + 2, f, 3) != 3)
+      return 0;
+    float *p = (float *)obj_push(&obj->positions, sizeof(vec3));
+    if (!p)
+      return 0;
+    memcpy(p, f, sizeof(vec3));
+  } else if (s[0] == 'v' && s[1] == 't' && (s[2] == ' ' || s[2] == '\t')) {
+    int n = parse_obj_floats(s + 3, f, 2);
+    if (n < 1)
+      return 0;
+    float *p = (float *)obj_push(&obj->uvs, sizeof(vec2));
+    if (!p)
+      return 0;
+    p[0] = f[0];
+    p[1] = n == 2 ? f[1] : 0.0f;
+  } else if (s[0] == 'v' && s[1] == 'n' && (s[2] == ' ' || s[2] == '\t')) {
+    if (parse_obj_floats(s + 3, f, 3) != 3)
+      return 0;
+    float *p = (float *)obj_push(&obj->normals, sizeof(vec3));
+    if (!p)
+      return 0;
+    memcpy(p, f, sizeof(vec3));
+  } else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+    s += 2;
+    obj_corner first, prev, c;
+    int n = 0;
+    while (1) {
+      while (*s == ' ' || *s == '\t')
+        s++;
+      if (*s == '\0' || *s == '\r' || *s == '\n' || *s == '#')
+        break;
+      if (!parse_obj_corner(&s, obj, &c))
+        return 0;
+      if (n == 0)
+        first = c;
+      if (n >= 2) {
+        const obj_corner fan[3] = {first, prev, c};
+        for (int k = 0; k < 3; k++) {
+          obj_corner *t = (obj_corner *)obj_push(&obj->corners, sizeof(c));
+          if (!t)
+            return 0;
+          *t = fan[k];
+        }
+      }
+      prev = c;
+      n++;
+    }
+    if (n < 3)
+      return 0;
+  }
+  return 1;
+}
+
+static uint32_t hash_obj_corner(const obj_corner *c) {
+  uint32_t h = 2166136261u;
+  uint32_t k[3] = {c->v, c->vt, c->vn};
+  for (int i = 0; i < 3; i++) {
+    h ^= k[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Welds corners with the same position, texture coordinate and normal into
+// one vertex, converting from OBJ's conventions to the renderer's: +y is up
+// in OBJ and down here, which also turns OBJ's counter-clockwise outward
+// faces into the inward facing winding the built-in shapes use; texture rows
+// run bottom up in OBJ and top down here.
+static int build_obj_model(model *model, const obj_data *obj) {
+  uint32_t corner_count = obj->corners.count;
+  const obj_corner *corners = (const obj_corner *)obj->corners.data;
+  const vec3 *positions = (const vec3 *)obj->positions.data;
+  const vec2 *uvs = (const vec2 *)obj->uvs.data;
+  const vec3 *normals = (const vec3 *)obj->normals.data;
+
+  if (corner_count > MAX_MODEL_TRIS * 3) {
+    printf("Mesh error: more than %u triangles\n", MAX_MODEL_TRIS);
+    return 0;
+  }
+  uint32_t table_size = 1;
+  while ((uint64_t)table_size < (uint64_t)corner_count * 2)
+    table_size <<= 1;
+  uint32_t *table = (uint32_t *)malloc(table_size * sizeof(uint32_t));
+  obj_corner *unique = (obj_corner *)malloc(corner_count * sizeof(obj_corner));
+  model->indices = (uint32_t *)malloc(corner_count * sizeof(uint32_t));
+  if (!table || !unique || !model->indices) {
+    free(table);
+    free(unique);
+    printf("Heap allocation error: %s\n", "init_model_obj()");
+    return 0;
+  }
+  memset(table, 0xFF, table_size * sizeof(uint32_t));
+
+  uint32_t vertex_count = 0;
+  for (uint32_t i = 0; i < corner_count; i++) {
+    const obj_corner *c = &corners[i];
+    uint32_t slot = hash_obj_corner(c) & (table_size - 1);
+    while (table[slot] != 0xFFFFFFFF &&
+           memcmp(&unique[table[slot]], c, sizeof(*c)) != 0)
+      slot = (slot + 1) & (table_size - 1);
+    if (table[slot] == 0xFFFFFFFF) {
+      unique[vertex_count] = *c;
+      table[slot] = vertex_count++;
+    }
+    model->indices[i] = table[slot];
+  }
+  free(table);
+
+  model->vertex_count = vertex_count;
+  model->tri_count = corner_count / 3;
+  model->vertices = (vec3 *)malloc(vertex_count * sizeof(vec3));
+  if (obj->uvs.count > 0)
+    model->uvs = (vec2 *)malloc(vertex_count * sizeof(vec2));
+  if (obj->normals.count > 0)
+    model->normals = (vec3 *)malloc(vertex_count * sizeof(vec3));
+  if (!model->vertices || (obj->uvs.count > 0 && !model->uvs) ||
+      (obj->normals.count > 0 && !model->normals)) {
+    free(unique);
+    printf("Heap allocation error: %s\n", "init_model_obj()");
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < vertex_count; i++) {
+    const obj_corner *c = &unique[i];
+    const float *p = positions[c->v - 1];
+    model->vertices[i][0] = p[0];
+    model->vertices[i][1] = -p[1];
+    model->vertices[i][2] = p[2];
+    if (model->uvs) {
+      model->uvs[i][0] = c->vt ? uvs[c->vt - 1][0] : 0.0f;
+      model->uvs[i][1] = c->vt ? 1.0f - uvs[c->vt - 1][1] : 0.0f;
+    }
+    if (model->normals) {
+      // Mirrored like the positions, then turned inward.
+      const float *n = c->vn ? normals[c->vn - 1] : NULL;
+      float len = n ? sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]) : 0.0f;
+      model->normals[i][0] = len > 1e-6f ? -n[0] / len : 0.0f;
+      model->normals[i][1] = len > 1e-6f ? n[1] / len : 0.0f;
+      model->normals[i][2] = len > 1e-6f ? -n[2] / len : 0.0f;
+    }
+  }
+  free(unique);
+  return 1;
+}
+
+static void free_obj_data(obj_data *obj) {
+  free(obj->positions.data);
+  free(obj->uvs.data);
+  free(obj->normals.data);
+  free(obj->corners.data);
+}
+
+// Imports the triangles of a Wavefront OBJ file, or fans of triangles for
+// larger polygons. Vertex normals and texture coordinates are taken from
+// the file when it has them and derived as for init_model() otherwise.
+// Returns 0, leaving model empty, on failure.
+int init_model_obj(model *model, const char *path, vec3 position,
+                   vec3 rotation, vec3 scale) {
+  memset(model, 0, sizeof(*model));
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    printf("Mesh error: cannot open %s\n", path);
+    return 0;
+  }
+
+  obj_data obj;
+  memset(&obj, 0, sizeof(obj));
+  char line[1024];
+  uint32_t line_number = 0, bad_line = 0;
+  // Stop reading once there are too many faces to import, rather than
+  // holding the rest of the file.
+  while (!bad_line && obj.corners.count <= MAX_MODEL_TRIS * 3 &&
+         fgets(line, sizeof(line), f)) {
+    line_number++;
+    size_t len = strlen(line);
+    // Only comments and huge polygons run this long; skip the rest of a
+    // comment and reject anything else.
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+      int c;
+      while ((c = fgetc(f)) != EOF && c != '\n')
+        ;
+      if (line[strspn(line, " \t")] != '#')
+        bad_line = line_number;
+    } else if (!parse_obj_line(line, &obj)) {
+      bad_line = line_number;
+    }
+  }
+  fclose(f);
+
+  int ok = 0;
+  if (bad_line)
+    printf("Mesh error: %s:%u is not valid OBJ\n", path, bad_line);
+  else if (obj.corners.count == 0)
+    printf("Mesh error: %s has no faces\n", path);
+  else if (obj.corners.count > MAX_MODEL_TRIS * 3)
+    printf("Mesh error: %s has more than %u triangles\n", path,
+           MAX_MODEL_TRIS);
+  else
+    ok = build_obj_model(model, &obj);
+  free_obj_data(&obj);
+  if (!ok) {
+    deallocate_model(model);
+    return 0;
+  }
+
+  memcpy(model->position, position, sizeof(vec3));
+  memcpy(model->rotation, rotation, sizeof(vec3));
+  memcpy(model->scale, scale, sizeof(vec3));
+  return init_model_attributes(model);
+}
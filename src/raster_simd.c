@@ -0,0 +1,20 @@
+#include "graphics.h"
+#include "raster_template.h"
+
+#ifdef RASTER_X86_KERNELS
+
+__attribute__((target("sse4.1"))) uint32_t
+rasterize_tri_zbuffered_sse41(SDL_Surface *surface, void *zbuffer,
+                              const raster_tri *tri, bbox2i clip) {
+  return raster_kernel_sse41(surface, zbuffer, tri, clip, NULL,
+                             tri->depth_format, tri->late_depth);
+}
+
+__attribute__((target("avx2"))) uint32_t
+rasterize_tri_zbuffered_avx2(SDL_Surface *surface, void *zbuffer,
+                             const raster_tri *tri, bbox2i clip) {
+  return raster_kernel_avx2(surface, zbuffer, tri, clip, NULL,
+                            tri->depth_format, tri->late_depth);
+}
+
+#endif
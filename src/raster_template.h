@@ -0,0 +1,669 @@
+// Rasterizer pixel loops, written once as templates and instantiated twice
+// over. The generic kernels rasterize_tri_zbuffered_scalar/_sse41/_avx2 pass
+// the triangle's own depth format, late depth flag and a NULL shader, which
+// means "whichever shader the triangle carries". DEFINE_RASTER_VARIANTS()
+// passes compile-time constants instead: the depth encode folds down to one
+// format and the batched shader is called directly, so it is inlined into
+// the pixel loop. Include after graphics.h, at most once per file.
+
+#if defined(__GNUC__)
+#define RASTER_TEMPLATE static inline __attribute__((always_inline))
+#else
+#define RASTER_TEMPLATE static inline
+#endif
+
+#define RASTER_OOW_EPS 1e-8f
+
+#define RASTER_SHADE(shader, tri, batch)                                       \
+  do {                                                                         \
+    if (shader)                                                                \
+      (shader)(batch);                                                         \
+    else                                                                       \
+      shade_fragment_batch(tri, batch);                                        \
+  } while (0)
+
+// Points vs->row at row y. Rows are evaluated from the origin rather than
+// stepped from the previous row so the result does not depend on where the
+// clip rect starts.
+RASTER_TEMPLATE void set_varying_row(varying_setup *vs, int y) {
+  float dy = (float)(y - vs->origin[1]);
+  for (uint32_t k = 0; k < vs->count; ++k)
+    vs->row[k] = vs->value[k] + dy * vs->step_y[k];
+  vs->row[MAX_VARYINGS] =
+      vs->value[MAX_VARYINGS] + dy * vs->step_y[MAX_VARYINGS];
+}
+
+// Fills batch->varyings for lanes [0, lanes) of a run starting at pixel x of
+// the current row of vs. Each varying over w, and 1/w, costs one
+// multiply-add per lane; the divide back by 1/w is made once per lane and
+// shared by every varying. The derivatives of varying v = V / Q, with V and
+// Q the planes of v over w and of 1/w, are (dV - v dQ) / Q. They are taken
+// at every lane, so a pixel's derivatives do not depend on how its row was
+// split into batches or which of its neighbours passed the depth test.
+RASTER_TEMPLATE void interpolate_varyings(fragment_batch *batch,
+                                          const varying_setup *vs, int x,
+                                          int lanes) {
+  float dx[FRAGMENT_BATCH_SIZE], w[FRAGMENT_BATCH_SIZE];
+  for (int l = 0; l < lanes; ++l) {
+    dx[l] = (float)(x + l - vs->origin[0]);
+    float oow = vs->row[MAX_VARYINGS] + dx[l] * vs->step_x[MAX_VARYINGS];
+    w[l] = oow > RASTER_OOW_EPS ? 1.0f / oow : 0.0f;
+  }
+  for (uint32_t k = 0; k < vs->count; ++k)
+    for (int l = 0; l < lanes; ++l)
+      batch->varyings[k][l] = (vs->row[k] + dx[l] * vs->step_x[k]) * w[l];
+
+  for (uint32_t k = 0; k < vs->count; ++k)
+    for (int l = 0; l < lanes; ++l) {
+      float v = batch->varyings[k][l];
+      batch->ddx[k][l] =
+          (vs->step_x[k] - v * vs->step_x[MAX_VARYINGS]) * w[l];
+      batch->ddy[k][l] =
+          (vs->step_y[k] - v * vs->step_y[MAX_VARYINGS]) * w[l];
+    }
+}
+
+static inline uint32_t depth_to_uint(float z) {
+  float z_clamped = fmaxf(0.0f, fminf(1.0f, z));
+  return (uint32_t)(z_clamped * 4294967295.0f);
+}
+
+static inline uint32_t float_bits(float f) {
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  return bits;
+}
+
+// Encodes interpolated NDC depth as the key of the given depth format. The
+// float formats clamp so that -0.0f and NaN become +0.0f, keeping the keys
+// ordered.
+static inline uint32_t encode_depth(int format, float z) {
+  float z_clamped = fminf(1.0f, z);
+  z_clamped = z_clamped > 0.0f ? z_clamped : 0.0f;
+  switch (format) {
+  case DEPTH_FLOAT32:
+    return float_bits(z_clamped);
+  case DEPTH_FLOAT32_REVERSED:
+    return float_bits(1.0f) - float_bits(z_clamped);
+  case DEPTH_UNORM16:
+    return (uint32_t)(fmaxf(0.0f, fminf(1.0f, z)) * 65535.0f);
+  default:
+    return depth_to_uint(z);
+  }
+}
+
+// Walks each row in runs of FRAGMENT_BATCH_SIZE pixels: the run's covered,
+// depth-passing fragments are gathered into one batch and shaded together,
+// then written back lane by lane.
+RASTER_TEMPLATE uint32_t raster_kernel_scalar(SDL_Surface *surface,
+                                              void *zbuffer,
+                                              const raster_tri *tri,
+                                              bbox2i clip,
+                                              fragment_batch_fn shader,
+                                              int depth_format,
+                                              int late_depth) {
+  uint32_t shaded = 0;
+
+  raster_setup rs;
+  if (!setup_raster_tri(surface, tri, clip, &rs))
+    return 0;
+  int sx = rs.bounds.min[0], ex = rs.bounds.max[0];
+  int sy = rs.bounds.min[1], ey = rs.bounds.max[1];
+  pixel_packing packing = get_pixel_packing(surface);
+  uint32_t *pixels = (uint32_t *)surface->pixels;
+  uint32_t *depth32 = (uint32_t *)zbuffer;
+  uint16_t *depth16 = (uint16_t *)zbuffer;
+  int wide_depth = depth_format_bytes(depth_format) == 4;
+  int pitch = surface->pitch / 4;
+
+  fragment_batch batch;
+  init_fragment_batch(&batch, tri);
+  varying_setup vs;
+  setup_varyings(tri, &vs);
+  uint32_t z_new[FRAGMENT_BATCH_SIZE];
+
+  int32_t e0_row = rs.e[0], e1_row = rs.e[1], e2_row = rs.e[2];
+  for (int y = sy; y <= ey; ++y) {
+    if (vs.count)
+      set_varying_row(&vs, y);
+    int32_t e0 = e0_row, e1 = e1_row, e2 = e2_row;
+    for (int x0 = sx; x0 <= ex; x0 += FRAGMENT_BATCH_SIZE) {
+      int lanes = ex - x0 + 1 < FRAGMENT_BATCH_SIZE ? ex - x0 + 1
+                                                    : FRAGMENT_BATCH_SIZE;
+      uint32_t covered = 0, write = 0;
+      for (int l = 0; l < lanes; ++l) {
+        if ((e0 | e1 | e2) >= 0) {
+          float u = (float)e0 * rs.scale + rs.offset[0];
+          float v = (float)e1 * rs.scale + rs.offset[1];
+          float w = (float)e2 * rs.scale + rs.offset[2];
+
+          float interp_oow =
+              u * tri->oow[0] + v * tri->oow[1] + w * tri->oow[2];
+          float z = u * tri->z_over_w[0] + v * tri->z_over_w[1] +
+                    w * tri->z_over_w[2];
+          uint32_t z_int = encode_depth(depth_format, z);
+          uint32_t index = y * pitch + x0 + l;
+          uint32_t z_old = wide_depth ? depth32[index] : depth16[index];
+
+          if (interp_oow > RASTER_OOW_EPS) {
+            covered |= 1u << l;
+            if (z_int < z_old)
+              write |= 1u << l;
+            z_new[l] = z_int;
+            batch.uv[0][l] = batch.position[0][l] = u;
+            batch.uv[1][l] = batch.position[1][l] = v;
+            batch.position[2][l] = w;
+          }
+        }
+        e0 += rs.step_x[0];
+        e1 += rs.step_x[1];
+        e2 += rs.step_x[2];
+      }
+
+      // Occluded fragments skip the shader unless the triangle needs late
+      // depth.
+      batch.mask = late_depth ? covered : write;
+      if (!batch.mask)
+        continue;
+      if (vs.count)
+        interpolate_varyings(&batch, &vs, x0, lanes);
+      uint32_t shade = batch.mask;
+      RASTER_SHADE(shader, tri, &batch);
+      shaded += __builtin_popcount(shade);
+      // Lanes the shader cleared from the mask are discarded.
+      if (late_depth)
+        write &= batch.mask;
+
+      for (int l = 0; l < lanes; ++l) {
+        if (!(write & (1u << l)))
+          continue;
+
+        vec4 FINAL_RGB = {batch.out[0][l], batch.out[1][l], batch.out[2][l],
+                          batch.out[3][l]};
+        FINAL_RGB[0] *= FINAL_RGB[3] / 255;
+        FINAL_RGB[1] *= FINAL_RGB[3] / 255;
+        FINAL_RGB[2] *= FINAL_RGB[3] / 255;
+
+        uint32_t index = y * pitch + x0 + l;
+        if (wide_depth)
+          depth32[index] = z_new[l];
+        else
+          depth16[index] = (uint16_t)z_new[l];
+        pixels[index] =
+            pack_pixel(packing, FINAL_RGB[0], FINAL_RGB[1], FINAL_RGB[2]);
+      }
+    }
+    e0_row += rs.step_y[0];
+    e1_row += rs.step_y[1];
+    e2_row += rs.step_y[2];
+  }
+  return shaded;
+}
+
+#ifdef RASTER_X86_KERNELS
+
+#include <immintrin.h>
+
+// Vector versions of raster_kernel_scalar(). Each iteration steps the
+// integer edge functions from setup_raster_tri() and evaluates the
+// barycentrics, the 1/w guard and the depth test for 4 (SSE4.1) or 8 (AVX2)
+// horizontally adjacent pixels with the same operations in the same order as
+// the scalar loop, so the pixels produced are identical. Depth is tested
+// before shading, so the fragment shader only runs for lanes that pass unless
+// late depth was asked for. The lanes are handed to it as one
+// fragment_batch and the colours it returns are packed four or eight at a
+// time; colour and zbuffer writes are masked by coverage and depth.
+// Lanes outside [sx, ex] are never written, since a neighbouring tile may
+// belong to another thread.
+
+// Premultiplies lanes 0-3 of batch->out by alpha / 255 and packs them,
+// truncating each channel to its low 8 bits as the scalar conversion to
+// uint8_t does.
+__attribute__((target("sse4.1"))) static inline __m128i
+pack_batch_sse41(const fragment_batch *batch, pixel_packing packing) {
+  const int shift[3] = {packing.r_shift, packing.g_shift, packing.b_shift};
+  __m128 a = _mm_div_ps(_mm_load_ps(batch->out[3]), _mm_set1_ps(255.0f));
+  __m128i rgb = _mm_set1_epi32((int)packing.alpha);
+  for (int c = 0; c < 3; c++) {
+    __m128i v = _mm_cvttps_epi32(_mm_mul_ps(_mm_load_ps(batch->out[c]), a));
+    v = _mm_and_si128(v, _mm_set1_epi32(0xFF));
+    rgb = _mm_or_si128(rgb, _mm_sll_epi32(v, _mm_cvtsi32_si128(shift[c])));
+  }
+  return rgb;
+}
+
+__attribute__((target("sse4.1"))) static inline __m128i
+depth_to_uint_sse41(__m128 z) {
+  // (uint32_t)(clamp(z, 0, 1) * 4294967295.0f); cvttps only covers the
+  // signed range, so the upper half is converted offset by 2^31.
+  const __m128 two31 = _mm_set1_ps(2147483648.0f);
+  z = _mm_max_ps(_mm_min_ps(z, _mm_set1_ps(1.0f)), _mm_setzero_ps());
+  z = _mm_mul_ps(z, _mm_set1_ps(4294967295.0f));
+  __m128 high = _mm_cmpge_ps(z, two31);
+  __m128i lo = _mm_cvttps_epi32(z);
+  __m128i hi = _mm_add_epi32(_mm_cvttps_epi32(_mm_sub_ps(z, two31)),
+                             _mm_set1_epi32((int)0x80000000u));
+  return _mm_blendv_epi8(lo, hi, _mm_castps_si128(high));
+}
+
+// Vector encode_depth() from graphics.c, with the same clamping.
+__attribute__((target("sse4.1"))) static inline __m128i
+encode_depth_sse41(int format, __m128 z) {
+  __m128 z_clamped =
+      _mm_max_ps(_mm_min_ps(z, _mm_set1_ps(1.0f)), _mm_setzero_ps());
+  switch (format) {
+  case DEPTH_FLOAT32:
+    return _mm_castps_si128(z_clamped);
+  case DEPTH_FLOAT32_REVERSED:
+    return _mm_sub_epi32(_mm_set1_epi32(0x3F800000),
+                         _mm_castps_si128(z_clamped));
+  case DEPTH_UNORM16:
+    return _mm_cvttps_epi32(_mm_mul_ps(z_clamped, _mm_set1_ps(65535.0f)));
+  default:
+    return depth_to_uint_sse41(z);
+  }
+}
+
+RASTER_TEMPLATE __attribute__((target("sse4.1"))) uint32_t
+raster_kernel_sse41(SDL_Surface *surface, void *zbuffer, const raster_tri *tri,
+                    bbox2i clip, fragment_batch_fn shader, int depth_format,
+                    int late_depth) {
+  uint32_t shaded = 0;
+
+  raster_setup rs;
+  if (!setup_raster_tri(surface, tri, clip, &rs))
+    return 0;
+  int sx = rs.bounds.min[0], ex = rs.bounds.max[0];
+  int sy = rs.bounds.min[1], ey = rs.bounds.max[1];
+  pixel_packing packing = get_pixel_packing(surface);
+  fragment_batch batch;
+  init_fragment_batch(&batch, tri);
+  varying_setup vs;
+  setup_varyings(tri, &vs);
+
+  const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i lane_e0 = _mm_mullo_epi32(lane, _mm_set1_epi32(rs.step_x[0]));
+  const __m128i lane_e1 = _mm_mullo_epi32(lane, _mm_set1_epi32(rs.step_x[1]));
+  const __m128i lane_e2 = _mm_mullo_epi32(lane, _mm_set1_epi32(rs.step_x[2]));
+  const __m128i step_e0 = _mm_set1_epi32(rs.step_x[0] * 4);
+  const __m128i step_e1 = _mm_set1_epi32(rs.step_x[1] * 4);
+  const __m128i step_e2 = _mm_set1_epi32(rs.step_x[2] * 4);
+  const __m128 scale = _mm_set1_ps(rs.scale);
+  const __m128 off0 = _mm_set1_ps(rs.offset[0]);
+  const __m128 off1 = _mm_set1_ps(rs.offset[1]);
+  const __m128 off2 = _mm_set1_ps(rs.offset[2]);
+  const __m128 oow_eps = _mm_set1_ps(RASTER_OOW_EPS);
+  const __m128 oow0 = _mm_set1_ps(tri->oow[0]);
+  const __m128 oow1 = _mm_set1_ps(tri->oow[1]);
+  const __m128 oow2 = _mm_set1_ps(tri->oow[2]);
+  const __m128 z0 = _mm_set1_ps(tri->z_over_w[0]);
+  const __m128 z1 = _mm_set1_ps(tri->z_over_w[1]);
+  const __m128 z2 = _mm_set1_ps(tri->z_over_w[2]);
+  const __m128i sign = _mm_set1_epi32((int)0x80000000u);
+
+  uint32_t *pixels = (uint32_t *)surface->pixels;
+  int pitch = surface->pitch / 4;
+  int wide_depth = depth_format_bytes(depth_format) == 4;
+
+  for (int y = sy; y <= ey; ++y) {
+    if (vs.count)
+      set_varying_row(&vs, y);
+    int row = y - sy;
+    __m128i e0 = _mm_add_epi32(
+        _mm_set1_epi32(rs.e[0] + row * rs.step_y[0]), lane_e0);
+    __m128i e1 = _mm_add_epi32(
+        _mm_set1_epi32(rs.e[1] + row * rs.step_y[1]), lane_e1);
+    __m128i e2 = _mm_add_epi32(
+        _mm_set1_epi32(rs.e[2] + row * rs.step_y[2]), lane_e2);
+    uint32_t *prow = pixels + y * pitch;
+    uint32_t *zrow = (uint32_t *)zbuffer + y * pitch;
+    uint16_t *zrow16 = (uint16_t *)zbuffer + y * pitch;
+
+    for (int x = sx; x <= ex; x += 4) {
+      __m128i outside = _mm_or_si128(_mm_or_si128(e0, e1), e2);
+      __m128 u = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e0), scale), off0);
+      __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e1), scale), off1);
+      __m128 w = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(e2), scale), off2);
+      e0 = _mm_add_epi32(e0, step_e0);
+      e1 = _mm_add_epi32(e1, step_e1);
+      e2 = _mm_add_epi32(e2, step_e2);
+
+      __m128 interp_oow = _mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(u, oow0), _mm_mul_ps(v, oow1)),
+          _mm_mul_ps(w, oow2));
+      // A lane is inside when none of its edge values is negative; only the
+      // sign bits of covered are used.
+      __m128 covered = _mm_andnot_ps(_mm_castsi128_ps(outside),
+                                     _mm_cmpgt_ps(interp_oow, oow_eps));
+
+      int remaining = ex - x + 1;
+      int mask = _mm_movemask_ps(covered);
+      if (remaining < 4)
+        mask &= (1 << remaining) - 1;
+      if (!mask)
+        continue;
+
+      __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(u, z0), _mm_mul_ps(v, z1)),
+                            _mm_mul_ps(w, z2));
+      __m128i z_int = encode_depth_sse41(depth_format, z);
+
+      __m128i zold;
+      if (remaining >= 4 && wide_depth) {
+        zold = _mm_loadu_si128((const __m128i *)(zrow + x));
+      } else if (remaining >= 4) {
+        zold = _mm_cvtepu16_epi32(
+            _mm_loadl_epi64((const __m128i *)(zrow16 + x)));
+      } else {
+        uint32_t tmp[4] = {0, 0, 0, 0};
+        for (int l = 0; l < remaining; l++)
+          tmp[l] = wide_depth ? zrow[x + l] : zrow16[x + l];
+        zold = _mm_loadu_si128((const __m128i *)tmp);
+      }
+      __m128i pass = _mm_cmpgt_epi32(_mm_xor_si128(zold, sign),
+                                     _mm_xor_si128(z_int, sign));
+      int write = mask & _mm_movemask_ps(_mm_castsi128_ps(pass));
+      int shade = late_depth ? mask : write;
+      if (!shade)
+        continue;
+
+      batch.mask = (uint32_t)shade;
+      _mm_store_ps(batch.uv[0], u);
+      _mm_store_ps(batch.uv[1], v);
+      _mm_store_ps(batch.position[0], u);
+      _mm_store_ps(batch.position[1], v);
+      _mm_store_ps(batch.position[2], w);
+      if (vs.count)
+        interpolate_varyings(&batch, &vs, x, 4);
+      RASTER_SHADE(shader, tri, &batch);
+      shaded += __builtin_popcount(shade);
+      if (late_depth)
+        write &= (int)batch.mask;
+      if (!write)
+        continue;
+
+      __m128i colors = pack_batch_sse41(&batch, packing);
+      if (write == 0xF) {
+        if (wide_depth)
+          _mm_storeu_si128((__m128i *)(zrow + x), z_int);
+        else
+          _mm_storel_epi64((__m128i *)(zrow16 + x),
+                           _mm_packus_epi32(z_int, z_int));
+        _mm_storeu_si128((__m128i *)(prow + x), colors);
+      } else {
+        uint32_t zs[4], cs[4];
+        _mm_storeu_si128((__m128i *)zs, z_int);
+        _mm_storeu_si128((__m128i *)cs, colors);
+        for (int l = 0; l < 4; l++)
+          if (write & (1 << l)) {
+            if (wide_depth)
+              zrow[x + l] = zs[l];
+            else
+              zrow16[x + l] = (uint16_t)zs[l];
+            prow[x + l] = cs[l];
+          }
+      }
+    }
+  }
+  return shaded;
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+depth_to_uint_avx2(__m256 z) {
+  const __m256 two31 = _mm256_set1_ps(2147483648.0f);
+  z = _mm256_max_ps(_mm256_min_ps(z, _mm256_set1_ps(1.0f)),
+                    _mm256_setzero_ps());
+  z = _mm256_mul_ps(z, _mm256_set1_ps(4294967295.0f));
+  __m256 high = _mm256_cmp_ps(z, two31, _CMP_GE_OQ);
+  __m256i lo = _mm256_cvttps_epi32(z);
+  __m256i hi = _mm256_add_epi32(_mm256_cvttps_epi32(_mm256_sub_ps(z, two31)),
+                                _mm256_set1_epi32((int)0x80000000u));
+  return _mm256_blendv_epi8(lo, hi, _mm256_castps_si256(high));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+encode_depth_avx2(int format, __m256 z) {
+  __m256 z_clamped = _mm256_max_ps(_mm256_min_ps(z, _mm256_set1_ps(1.0f)),
+                                   _mm256_setzero_ps());
+  switch (format) {
+  case DEPTH_FLOAT32:
+    return _mm256_castps_si256(z_clamped);
+  case DEPTH_FLOAT32_REVERSED:
+    return _mm256_sub_epi32(_mm256_set1_epi32(0x3F800000),
+                            _mm256_castps_si256(z_clamped));
+  case DEPTH_UNORM16:
+    return _mm256_cvttps_epi32(
+        _mm256_mul_ps(z_clamped, _mm256_set1_ps(65535.0f)));
+  default:
+    return depth_to_uint_avx2(z);
+  }
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+pack_batch_avx2(const fragment_batch *batch, pixel_packing packing) {
+  const int shift[3] = {packing.r_shift, packing.g_shift, packing.b_shift};
+  __m256 a =
+      _mm256_div_ps(_mm256_load_ps(batch->out[3]), _mm256_set1_ps(255.0f));
+  __m256i rgb = _mm256_set1_epi32((int)packing.alpha);
+  for (int c = 0; c < 3; c++) {
+    __m256i v = _mm256_cvttps_epi32(
+        _mm256_mul_ps(_mm256_load_ps(batch->out[c]), a));
+    v = _mm256_and_si256(v, _mm256_set1_epi32(0xFF));
+    rgb = _mm256_or_si256(rgb,
+                          _mm256_sll_epi32(v, _mm_cvtsi32_si128(shift[c])));
+  }
+  return rgb;
+}
+
+// Packs eight 32-bit depth keys below 2^16 into eight 16-bit values.
+__attribute__((target("avx2"))) static inline __m128i
+pack_depth16_avx2(__m256i z) {
+  __m256i packed = _mm256_packus_epi32(z, z);
+  packed = _mm256_permute4x64_epi64(packed, 0xD8);
+  return _mm256_castsi256_si128(packed);
+}
+
+RASTER_TEMPLATE __attribute__((target("avx2"))) uint32_t
+raster_kernel_avx2(SDL_Surface *surface, void *zbuffer, const raster_tri *tri,
+                   bbox2i clip, fragment_batch_fn shader, int depth_format,
+                   int late_depth) {
+  uint32_t shaded = 0;
+
+  raster_setup rs;
+  if (!setup_raster_tri(surface, tri, clip, &rs))
+    return 0;
+  int sx = rs.bounds.min[0], ex = rs.bounds.max[0];
+  int sy = rs.bounds.min[1], ey = rs.bounds.max[1];
+  pixel_packing packing = get_pixel_packing(surface);
+  fragment_batch batch;
+  init_fragment_batch(&batch, tri);
+  varying_setup vs;
+  setup_varyings(tri, &vs);
+
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  const __m256i lane_e0 =
+      _mm256_mullo_epi32(lane, _mm256_set1_epi32(rs.step_x[0]));
+  const __m256i lane_e1 =
+      _mm256_mullo_epi32(lane, _mm256_set1_epi32(rs.step_x[1]));
+  const __m256i lane_e2 =
+      _mm256_mullo_epi32(lane, _mm256_set1_epi32(rs.step_x[2]));
+  const __m256i step_e0 = _mm256_set1_epi32(rs.step_x[0] * 8);
+  const __m256i step_e1 = _mm256_set1_epi32(rs.step_x[1] * 8);
+  const __m256i step_e2 = _mm256_set1_epi32(rs.step_x[2] * 8);
+  const __m256 scale = _mm256_set1_ps(rs.scale);
+  const __m256 off0 = _mm256_set1_ps(rs.offset[0]);
+  const __m256 off1 = _mm256_set1_ps(rs.offset[1]);
+  const __m256 off2 = _mm256_set1_ps(rs.offset[2]);
+  const __m256 oow_eps = _mm256_set1_ps(RASTER_OOW_EPS);
+  const __m256 oow0 = _mm256_set1_ps(tri->oow[0]);
+  const __m256 oow1 = _mm256_set1_ps(tri->oow[1]);
+  const __m256 oow2 = _mm256_set1_ps(tri->oow[2]);
+  const __m256 z0 = _mm256_set1_ps(tri->z_over_w[0]);
+  const __m256 z1 = _mm256_set1_ps(tri->z_over_w[1]);
+  const __m256 z2 = _mm256_set1_ps(tri->z_over_w[2]);
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256i sign = _mm256_set1_epi32((int)0x80000000u);
+
+  uint32_t *pixels = (uint32_t *)surface->pixels;
+  int pitch = surface->pitch / 4;
+  int wide_depth = depth_format_bytes(depth_format) == 4;
+
+  for (int y = sy; y <= ey; ++y) {
+    if (vs.count)
+      set_varying_row(&vs, y);
+    int row = y - sy;
+    __m256i e0 = _mm256_add_epi32(
+        _mm256_set1_epi32(rs.e[0] + row * rs.step_y[0]), lane_e0);
+    __m256i e1 = _mm256_add_epi32(
+        _mm256_set1_epi32(rs.e[1] + row * rs.step_y[1]), lane_e1);
+    __m256i e2 = _mm256_add_epi32(
+        _mm256_set1_epi32(rs.e[2] + row * rs.step_y[2]), lane_e2);
+    uint32_t *prow = pixels + y * pitch;
+    uint32_t *zrow = (uint32_t *)zbuffer + y * pitch;
+    uint16_t *zrow16 = (uint16_t *)zbuffer + y * pitch;
+
+    for (int x = sx; x <= ex; x += 8) {
+      __m256i outside = _mm256_or_si256(_mm256_or_si256(e0, e1), e2);
+      __m256 u = _mm256_add_ps(
+          _mm256_mul_ps(_mm256_cvtepi32_ps(e0), scale), off0);
+      __m256 v = _mm256_add_ps(
+          _mm256_mul_ps(_mm256_cvtepi32_ps(e1), scale), off1);
+      __m256 w = _mm256_add_ps(
+          _mm256_mul_ps(_mm256_cvtepi32_ps(e2), scale), off2);
+      e0 = _mm256_add_epi32(e0, step_e0);
+      e1 = _mm256_add_epi32(e1, step_e1);
+      e2 = _mm256_add_epi32(e2, step_e2);
+
+      __m256 interp_oow = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(u, oow0), _mm256_mul_ps(v, oow1)),
+          _mm256_mul_ps(w, oow2));
+      // Only the sign bits of covered are used, as in the SSE4.1 kernel.
+      __m256 covered = _mm256_andnot_ps(
+          _mm256_castsi256_ps(outside),
+          _mm256_cmp_ps(interp_oow, oow_eps, _CMP_GT_OQ));
+
+      int remaining = ex - x + 1;
+      int mask = _mm256_movemask_ps(covered);
+      if (remaining < 8)
+        mask &= (1 << remaining) - 1;
+      if (!mask)
+        continue;
+
+      __m256 z = _mm256_add_ps(
+          _mm256_add_ps(_mm256_mul_ps(u, z0), _mm256_mul_ps(v, z1)),
+          _mm256_mul_ps(w, z2));
+      __m256i z_int = encode_depth_avx2(depth_format, z);
+
+      __m256i lanes = _mm256_cmpeq_epi32(
+          _mm256_and_si256(_mm256_set1_epi32(mask), lane_bits), lane_bits);
+      __m256i zold;
+      if (wide_depth) {
+        zold = _mm256_maskload_epi32((const int *)(zrow + x), lanes);
+      } else if (remaining >= 8) {
+        zold = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i *)(zrow16 + x)));
+      } else {
+        uint32_t tmp[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        for (int l = 0; l < remaining; l++)
+          tmp[l] = zrow16[x + l];
+        zold = _mm256_loadu_si256((const __m256i *)tmp);
+      }
+      __m256i pass = _mm256_cmpgt_epi32(_mm256_xor_si256(zold, sign),
+                                        _mm256_xor_si256(z_int, sign));
+      __m256i write = _mm256_and_si256(lanes, pass);
+      int write_mask = _mm256_movemask_ps(_mm256_castsi256_ps(write));
+      int shade = late_depth ? mask : write_mask;
+      if (!shade)
+        continue;
+
+      batch.mask = (uint32_t)shade;
+      _mm256_store_ps(batch.uv[0], u);
+      _mm256_store_ps(batch.uv[1], v);
+      _mm256_store_ps(batch.position[0], u);
+      _mm256_store_ps(batch.position[1], v);
+      _mm256_store_ps(batch.position[2], w);
+      if (vs.count)
+        interpolate_varyings(&batch, &vs, x, 8);
+      RASTER_SHADE(shader, tri, &batch);
+      shaded += __builtin_popcount(shade);
+      if (late_depth) {
+        write_mask &= (int)batch.mask;
+        write = _mm256_cmpeq_epi32(
+            _mm256_and_si256(_mm256_set1_epi32(write_mask), lane_bits),
+            lane_bits);
+      }
+      if (!write_mask)
+        continue;
+
+      if (wide_depth) {
+        _mm256_maskstore_epi32((int *)(zrow + x), write, z_int);
+      } else if (write_mask == 0xFF) {
+        _mm_storeu_si128((__m128i *)(zrow16 + x), pack_depth16_avx2(z_int));
+      } else {
+        uint32_t zs[8];
+        _mm256_storeu_si256((__m256i *)zs, z_int);
+        for (int l = 0; l < 8; l++)
+          if (write_mask & (1 << l))
+            zrow16[x + l] = (uint16_t)zs[l];
+      }
+      _mm256_maskstore_epi32((int *)(prow + x), write,
+                             pack_batch_avx2(&batch, packing));
+    }
+  }
+  return shaded;
+}
+
+
+#endif
+
+// Instantiates name##_<kernel>_<tag> for every depth format and pixel loop,
+// with shader and late_depth baked in, and a table name[DEPTH_FORMAT_COUNT]
+// for register_raster_variants(). Kernels the build cannot target are left
+// NULL, so find_raster_variant() falls back to the generic loop for them.
+#define RASTER_VARIANT_SCALAR(name, shader, late_depth, tag, format)           \
+  static uint32_t name##_scalar_##tag(SDL_Surface *surface, void *zbuffer,    \
+                                      const raster_tri *tri, bbox2i clip) {    \
+    return raster_kernel_scalar(surface, zbuffer, tri, clip, shader, format,   \
+                                late_depth);                                   \
+  }
+
+#ifdef RASTER_X86_KERNELS
+#define RASTER_VARIANT_SIMD(name, shader, late_depth, tag, format)             \
+  __attribute__((target("sse4.1"))) static uint32_t name##_sse41_##tag(        \
+      SDL_Surface *surface, void *zbuffer, const raster_tri *tri,              \
+      bbox2i clip) {                                                           \
+    return raster_kernel_sse41(surface, zbuffer, tri, clip, shader, format,    \
+                               late_depth);                                    \
+  }                                                                            \
+  __attribute__((target("avx2"))) static uint32_t name##_avx2_##tag(           \
+      SDL_Surface *surface, void *zbuffer, const raster_tri *tri,              \
+      bbox2i clip) {                                                           \
+    return raster_kernel_avx2(surface, zbuffer, tri, clip, shader, format,     \
+                              late_depth);                                     \
+  }
+#define RASTER_VARIANT_ENTRY(name, shader, late_depth, tag, format)            \
+  {shader,                                                                     \
+   format,                                                                     \
+   late_depth,                                                                 \
+   {NULL, name##_scalar_##tag, name##_sse41_##tag, name##_avx2_##tag}}
+#else
+#define RASTER_VARIANT_SIMD(name, shader, late_depth, tag, format)
+#define RASTER_VARIANT_ENTRY(name, shader, late_depth, tag, format)            \
+  {shader, format, late_depth, {NULL, name##_scalar_##tag, NULL, NULL}}
+#endif
+
+#define RASTER_VARIANT(name, shader, late_depth, tag, format)                  \
+  RASTER_VARIANT_SCALAR(name, shader, late_depth, tag, format)                 \
+  RASTER_VARIANT_SIMD(name, shader, late_depth, tag, format)
+
+#define DEFINE_RASTER_VARIANTS(name, shader, late_depth)                       \
+  RASTER_VARIANT(name, shader, late_depth, unorm32, DEPTH_UNORM32)             \
+  RASTER_VARIANT(name, shader, late_depth, float32, DEPTH_FLOAT32)             \
+  RASTER_VARIANT(name, shader, late_depth, float32_rev,                        \
+                 DEPTH_FLOAT32_REVERSED)                                       \
+  RASTER_VARIANT(name, shader, late_depth, unorm16, DEPTH_UNORM16)             \
+  static const raster_variant name[DEPTH_FORMAT_COUNT] = {                     \
+      RASTER_VARIANT_ENTRY(name, shader, late_depth, unorm32, DEPTH_UNORM32),  \
+      RASTER_VARIANT_ENTRY(name, shader, late_depth, float32, DEPTH_FLOAT32),  \
+      RASTER_VARIANT_ENTRY(name, shader, late_depth, float32_rev,              \
+                           DEPTH_FLOAT32_REVERSED),                            \
+      RASTER_VARIANT_ENTRY(name, shader, late_depth, unorm16, DEPTH_UNORM16)}
@@ -0,0 +1,429 @@
+#include "graphics.h"
+
+#include <stdlib.h>
+
+#define VARIFYHEAP(ptr, str, type)                                             \
+  do {                                                                         \
+    if (!(ptr)) {                                                              \
+      printf("Heap allocation error: %s\n", str);                              \
+      return type;                                                             \
+    }                                                                          \
+  } while (0)
+
+// Texel storage starts on a cache-line boundary so every tile is exactly one
+// line.
+#define TEXTURE_ALIGN 64
+
+#define TEXEL_R(t) ((t) & 0xFF)
+#define TEXEL_G(t) (((t) >> 8) & 0xFF)
+#define TEXEL_B(t) (((t) >> 16) & 0xFF)
+#define TEXEL_A(t) ((t) >> 24)
+
+static inline uint32_t make_texel(uint32_t r, uint32_t g, uint32_t b,
+                                  uint32_t a) {
+  return r | g << 8 | b << 16 | a << 24;
+}
+
+// Index of texel (x, y) of a level: tiles are stored row by row, and the
+// texels of a tile row by row inside it.
+static inline uint32_t texel_index(const texture_level *level, uint32_t x,
+                                   uint32_t y) {
+  uint32_t tile = (y >> TEXTURE_TILE_BITS) * level->tiles_x +
+                  (x >> TEXTURE_TILE_BITS);
+  return level->offset + (tile << (2 * TEXTURE_TILE_BITS)) +
+         ((y & (TEXTURE_TILE - 1)) << TEXTURE_TILE_BITS) +
+         (x & (TEXTURE_TILE - 1));
+}
+
+static inline uint32_t fetch_texel(const texture *t, const texture_level *level,
+                                   uint32_t x, uint32_t y) {
+  return t->texels[texel_index(level, x, y)];
+}
+
+// Wraps an integer texel coordinate into [0, size).
+static inline uint32_t wrap_texel(int c, int size) {
+  c %= size;
+  return (uint32_t)(c < 0 ? c + size : c);
+}
+
+// Wraps a texture coordinate into [0, 1], so scaling it by a level's size
+// stays within int range. Infinite and NaN coordinates, which surfaces seen
+// edge on can produce, read from 0.
+static inline float wrap_coord(float c) {
+  return isfinite(c) ? c - floorf(c) : 0.0f;
+}
+
+static uint32_t *allocate_texels(size_t count) {
+  uint8_t *raw = (uint8_t *)malloc(count * sizeof(uint32_t) + TEXTURE_ALIGN +
+                                   sizeof(void *));
+  if (!raw)
+    return NULL;
+  uintptr_t addr = (uintptr_t)raw + sizeof(void *) + TEXTURE_ALIGN - 1;
+  addr &= ~(uintptr_t)(TEXTURE_ALIGN - 1);
+  ((void **)addr)[-1] = raw;
+  return (uint32_t *)addr;
+}
+
+static void deallocate_texels(uint32_t *texels) {
+  if (texels)
+    free(((void **)texels)[-1]);
+}
+
+// Box filters level i - 1 into level i. When a size of the larger level is
+// odd its last row or column is left out.
+static void build_mip_level(texture *t, uint8_t i) {
+  const texture_level *src = &t->levels[i - 1];
+  const texture_level *dst = &t->levels[i];
+  for (uint32_t y = 0; y < dst->height; y++)
+    for (uint32_t x = 0; x < dst->width; x++) {
+      uint32_t x0 = x * 2, y0 = y * 2;
+      uint32_t x1 = x0 + 1 < src->width ? x0 + 1 : x0;
+      uint32_t y1 = y0 + 1 < src->height ? y0 + 1 : y0;
+      uint32_t s[4] = {
+          fetch_texel(t, src, x0, y0), fetch_texel(t, src, x1, y0),
+          fetch_texel(t, src, x0, y1), fetch_texel(t, src, x1, y1)};
+      uint32_t r = 2, g = 2, b = 2, a = 2;
+      for (int k = 0; k < 4; k++) {
+        r += TEXEL_R(s[k]);
+        g += TEXEL_G(s[k]);
+        b += TEXEL_B(s[k]);
+        a += TEXEL_A(s[k]);
+      }
+      t->texels[texel_index(dst, x, y)] =
+          make_texel(r >> 2, g >> 2, b >> 2, a >> 2);
+    }
+}
+
+// Builds a texture from width * height tightly packed texels of channels
+// bytes each, rows top to bottom: 1 is grey, 3 RGB and 4 RGBA. The full mip
+// chain down to 1x1 is built here.
+texture *create_texture(uint16_t width, uint16_t height, const uint8_t *data,
+                        int channels) {
+  if (width == 0 || height == 0 ||
+      (channels != 1 && channels != 3 && channels != 4)) {
+    printf("Texture error: unsupported %ux%u texture with %d channels\n",
+           width, height, channels);
+    return NULL;
+  }
+
+  texture *t = (texture *)calloc(1, sizeof(texture));
+  VARIFYHEAP(t, "create_texture()", NULL);
+
+  size_t total = 0;
+  uint16_t w = width, h = height;
+  while (t->level_count < TEXTURE_MAX_LEVELS) {
+    texture_level *level = &t->levels[t->level_count++];
+    level->width = w;
+    level->height = h;
+    level->tiles_x = (w + TEXTURE_TILE - 1) >> TEXTURE_TILE_BITS;
+    level->offset = (uint32_t)total;
+    uint32_t tiles_y = (h + TEXTURE_TILE - 1) >> TEXTURE_TILE_BITS;
+    total += (size_t)level->tiles_x * tiles_y << (2 * TEXTURE_TILE_BITS);
+    if (w == 1 && h == 1)
+      break;
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+  }
+
+  t->texels = allocate_texels(total);
+  if (!t->texels) {
+    printf("Heap allocation error: %s\n", "create_texture()");
+    free(t);
+    return NULL;
+  }
+  memset(t->texels, 0, total * sizeof(uint32_t));
+
+  for (uint32_t y = 0; y < height; y++)
+    for (uint32_t x = 0; x < width; x++) {
+      const uint8_t *p = data + ((size_t)y * width + x) * channels;
+      uint32_t texel = channels == 1   ? make_texel(p[0], p[0], p[0], 255)
+                       : channels == 3 ? make_texel(p[0], p[1], p[2], 255)
+                                       : make_texel(p[0], p[1], p[2], p[3]);
+      t->texels[texel_index(&t->levels[0], x, y)] = texel;
+    }
+  for (uint8_t i = 1; i < t->level_count; i++)
+    build_mip_level(t, i);
+  return t;
+}
+
+void deallocate_texture(texture *t) {
+  VARIFYHEAP(t, "deallocate_texture()", );
+  deallocate_texels(t->texels);
+  free(t);
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    printf("Texture error: cannot open %s\n", path);
+    return NULL;
+  }
+  uint8_t *data = NULL;
+  if (fseek(f, 0, SEEK_END) == 0) {
+    long size = ftell(f);
+    if (size >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+      data = (uint8_t *)malloc(size > 0 ? (size_t)size : 1);
+      if (data && fread(data, 1, (size_t)size, f) != (size_t)size) {
+        free(data);
+        data = NULL;
+      }
+      *len = (size_t)size;
+    }
+  }
+  fclose(f);
+  if (!data)
+    printf("Texture error: cannot read %s\n", path);
+  return data;
+}
+
+// Skips whitespace and # comments between PPM header fields, then parses an
+// unsigned decimal.
+static int read_ppm_field(const uint8_t *data, size_t len, size_t *at,
+                          uint32_t *out) {
+  while (*at < len) {
+    if (data[*at] == '#')
+      while (*at < len && data[*at] != '\n')
+        (*at)++;
+    else if (data[*at] == ' ' || data[*at] == '\t' || data[*at] == '\r' ||
+             data[*at] == '\n')
+      (*at)++;
+    else
+      break;
+  }
+  if (*at >= len || data[*at] < '0' || data[*at] > '9')
+    return 0;
+  *out = 0;
+  while (*at < len && data[*at] >= '0' && data[*at] <= '9' && *out < 65536)
+    *out = *out * 10 + (data[(*at)++] - '0');
+  return 1;
+}
+
+// Binary PPM (P6) and PGM (P5) with 8-bit samples.
+static texture *decode_ppm(const uint8_t *data, size_t len, const char *path) {
+  size_t at = 2;
+  uint32_t width, height, maxval;
+  int channels = data[1] == '6' ? 3 : 1;
+  if (!read_ppm_field(data, len, &at, &width) ||
+      !read_ppm_field(data, len, &at, &height) ||
+      !read_ppm_field(data, len, &at, &maxval) || maxval == 0 ||
+      maxval > 255 || width > 65535 || height > 65535) {
+    printf("Texture error: malformed or 16-bit PPM %s\n", path);
+    return NULL;
+  }
+  // Exactly one whitespace byte separates the header from the samples.
+  at++;
+  if (at > len || len - at < (size_t)width * height * channels) {
+    printf("Texture error: truncated PPM %s\n", path);
+    return NULL;
+  }
+
+  if (maxval == 255)
+    return create_texture((uint16_t)width, (uint16_t)height, data + at,
+                          channels);
+
+  size_t count = (size_t)width * height * channels;
+  uint8_t *scaled = (uint8_t *)malloc(count);
+  VARIFYHEAP(scaled, "decode_ppm()", NULL);
+  for (size_t i = 0; i < count; i++) {
+    uint32_t v = data[at + i] < maxval ? data[at + i] : maxval;
+    scaled[i] = (uint8_t)((v * 255 + maxval / 2) / maxval);
+  }
+  texture *t = create_texture((uint16_t)width, (uint16_t)height, scaled,
+                              channels);
+  free(scaled);
+  return t;
+}
+
+// Uncompressed and run-length encoded true-colour (2, 10) and greyscale
+// (3, 11) TGA with 8, 24 or 32 bits per pixel. Colour-mapped images are not
+// supported.
+static texture *decode_tga(const uint8_t *data, size_t len, const char *path) {
+  if (len < 18) {
+    printf("Texture error: truncated TGA %s\n", path);
+    return NULL;
+  }
+  uint8_t type = data[2];
+  uint32_t width = data[12] | (uint32_t)data[13] << 8;
+  uint32_t height = data[14] | (uint32_t)data[15] << 8;
+  uint32_t bytes = data[16] / 8;
+  int top_down = (data[17] & 0x20) != 0;
+  int grey = type == 3 || type == 11;
+  int rle = type == 10 || type == 11;
+  if (data[1] != 0 || (type != 2 && type != 3 && type != 10 && type != 11) ||
+      (grey ? bytes != 1 : (bytes != 3 && bytes != 4)) || width == 0 ||
+      height == 0) {
+    printf("Texture error: unsupported TGA %s\n", path);
+    return NULL;
+  }
+
+  size_t at = 18 + data[0];
+  size_t count = (size_t)width * height;
+  int channels = grey ? 1 : (int)bytes;
+  uint8_t *pixels = (uint8_t *)malloc(count * channels);
+  VARIFYHEAP(pixels, "decode_tga()", NULL);
+
+  size_t i = 0;
+  while (i < count) {
+    size_t run = 1;
+    int repeat = 0;
+    if (rle) {
+      if (at >= len)
+        break;
+      repeat = (data[at] & 0x80) != 0;
+      run = (data[at++] & 0x7F) + 1;
+      if (run > count - i)
+        run = count - i;
+    }
+    if (at + (repeat ? 1 : run) * bytes > len)
+      break;
+    for (size_t k = 0; k < run; k++, i++) {
+      const uint8_t *p = data + at + (repeat ? 0 : k * bytes);
+      // TGA rows run bottom to top unless the descriptor says otherwise,
+      // and colour is stored BGR(A).
+      size_t x = i % width, y = i / width;
+      if (!top_down)
+        y = height - 1 - y;
+      uint8_t *out = pixels + (y * width + x) * channels;
+      if (grey) {
+        out[0] = p[0];
+      } else {
+        out[0] = p[2];
+        out[1] = p[1];
+        out[2] = p[0];
+        if (channels == 4)
+          out[3] = p[3];
+      }
+    }
+    at += (repeat ? 1 : run) * bytes;
+  }
+
+  texture *t = NULL;
+  if (i < count)
+    printf("Texture error: truncated TGA %s\n", path);
+  else
+    t = create_texture((uint16_t)width, (uint16_t)height, pixels, channels);
+  free(pixels);
+  return t;
+}
+
+// Loads a binary PPM/PGM, recognised by its magic number, or a TGA.
+texture *load_texture(const char *path) {
+  size_t len = 0;
+  uint8_t *data = read_file(path, &len);
+  if (!data)
+    return NULL;
+
+  texture *t;
+  if (len >= 2 && data[0] == 'P' && (data[1] == '5' || data[1] == '6'))
+    t = decode_ppm(data, len, path);
+  else
+    t = decode_tga(data, len, path);
+  free(data);
+  return t;
+}
+
+// Loads headerless texels laid out as for create_texture().
+texture *load_texture_raw(const char *path, uint16_t width, uint16_t height,
+                          int channels) {
+  size_t len = 0;
+  uint8_t *data = read_file(path, &len);
+  if (!data)
+    return NULL;
+
+  texture *t = NULL;
+  if (len < (size_t)width * height * channels)
+    printf("Texture error: %s is smaller than %ux%u texels\n", path, width,
+           height);
+  else
+    t = create_texture(width, height, data, channels);
+  free(data);
+  return t;
+}
+
+// log2 of the texels of the base level a pixel step covers, along the axis
+// of the screen where the footprint is longest.
+float texture_lod(const texture *t, float dudx, float dvdx, float dudy,
+                  float dvdy) {
+  float w = t->levels[0].width, h = t->levels[0].height;
+  float x = (dudx * w) * (dudx * w) + (dvdx * h) * (dvdx * h);
+  float y = (dudy * w) * (dudy * w) + (dvdy * h) * (dvdy * h);
+  return 0.5f * log2f(fmaxf(fmaxf(x, y), 1e-12f));
+}
+
+// lod is clamped before it is converted, since derivatives blow up to
+// infinity where a triangle runs off towards the horizon.
+static const texture_level *select_level(const texture *t, float lod) {
+  float last = (float)(t->level_count - 1);
+  int i = lod > 0.0f ? (int)(fminf(lod, last) + 0.5f) : 0;
+  return &t->levels[i];
+}
+
+static void sample_level(const texture *t, const texture_level *level,
+                         int filter, float u, float v, float *out) {
+  u = wrap_coord(u);
+  v = wrap_coord(v);
+  if (filter == TEXTURE_FILTER_NEAREST) {
+    uint32_t texel = fetch_texel(
+        t, level, wrap_texel((int)floorf(u * level->width), level->width),
+        wrap_texel((int)floorf(v * level->height), level->height));
+    out[0] = TEXEL_R(texel);
+    out[1] = TEXEL_G(texel);
+    out[2] = TEXEL_B(texel);
+    out[3] = TEXEL_A(texel);
+    return;
+  }
+
+  float x = u * level->width - 0.5f, y = v * level->height - 0.5f;
+  float fx = floorf(x), fy = floorf(y);
+  float ax = x - fx, ay = y - fy;
+  uint32_t x0 = wrap_texel((int)fx, level->width);
+  uint32_t y0 = wrap_texel((int)fy, level->height);
+  uint32_t x1 = x0 + 1 < level->width ? x0 + 1 : 0;
+  uint32_t y1 = y0 + 1 < level->height ? y0 + 1 : 0;
+  uint32_t s00 = fetch_texel(t, level, x0, y0);
+  uint32_t s10 = fetch_texel(t, level, x1, y0);
+  uint32_t s01 = fetch_texel(t, level, x0, y1);
+  uint32_t s11 = fetch_texel(t, level, x1, y1);
+  for (int c = 0; c < 4; c++) {
+    float top = (float)((s00 >> (8 * c)) & 0xFF) * (1.0f - ax) +
+                (float)((s10 >> (8 * c)) & 0xFF) * ax;
+    float bottom = (float)((s01 >> (8 * c)) & 0xFF) * (1.0f - ax) +
+                   (float)((s11 >> (8 * c)) & 0xFF) * ax;
+    out[c] = top * (1.0f - ay) + bottom * ay;
+  }
+}
+
+// Samples t at (u, v), wrapping outside [0, 1), from the mip level nearest
+// lod. out is RGBA in [0, 255].
+void sample_texture(const texture *t, int filter, float u, float v, float lod,
+                    vec4 out) {
+  sample_level(t, select_level(t, lod), filter, u, v, out);
+}
+
+// Samples t for every lane of batch set in its mask, at the coordinates held
+// in varyings u and u + 1. Each lane reads the mip level picked from its own
+// screen derivatives of the varyings, so the result for a pixel does not
+// depend on which batch it was shaded in. Without a texture every lane reads
+// opaque white.
+void sample_texture_batch(const texture *t, int filter,
+                          const fragment_batch *batch, int u,
+                          float out[4][FRAGMENT_BATCH_SIZE]) {
+  if (!t) {
+    for (int c = 0; c < 4; c++)
+      for (int l = 0; l < FRAGMENT_BATCH_SIZE; l++)
+        out[c][l] = 255.0f;
+    return;
+  }
+  for (int l = 0; l < FRAGMENT_BATCH_SIZE; l++) {
+    if (!(batch->mask & (1u << l)))
+      continue;
+    const texture_level *level = select_level(
+        t, texture_lod(t, batch->ddx[u][l], batch->ddx[u + 1][l],
+                       batch->ddy[u][l], batch->ddy[u + 1][l]));
+    float texel[4];
+    sample_level(t, level, filter, batch->varyings[u][l],
+                 batch->varyings[u + 1][l], texel);
+    for (int c = 0; c < 4; c++)
+      out[c][l] = texel[c];
+  }
+}
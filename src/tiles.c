@@ -0,0 +1,339 @@
+#include "graphics.h"
+
+#define VARIFYHEAP(ptr, str, type)                                             \
+  do {                                                                         \
+    if (!(ptr)) {                                                              \
+      printf("Heap allocation error: %s\n", str);                              \
+      return type;                                                             \
+    }                                                                          \
+  } while (0)
+
+typedef struct tile_bin {
+  uint32_t *tris;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t depth_epoch;
+} tile_bin;
+
+typedef struct tile_worker {
+  tile_binner *binner;
+  SDL_Thread *thread;
+  uint64_t pixels_shaded;
+} tile_worker;
+
+// Sort-middle binning: setup appends each screen-space triangle once and
+// records its index in every tile its bounding box touches. On flush, the
+// calling thread and the worker pool claim whole tiles from a shared counter
+// and rasterize each tile's triangles in submission order, clipped to the
+// tile. A tile's pixels and zbuffer entries are only ever written by the
+// thread that claimed it, so the pixel path takes no locks and the result
+// matches the immediate path exactly.
+//
+// A clear requested with clear_tile_binner() is folded into the next flush:
+// each thread clears the colour of the tiles it claims just before
+// rasterizing them, while the tile is about to be in its cache anyway. Depth
+// is tagged per tile with the epoch of the last clear and is only reset the
+// first time a triangle lands in the tile afterwards, so depth in tiles that
+// nothing covers is never touched.
+struct tile_binner {
+  SDL_Surface *surface;
+  void *zbuffer;
+  int depth_format;
+  hiz_buffer *hiz;
+
+  uint16_t tiles_x;
+  uint16_t tiles_y;
+  tile_bin *bins;
+
+  raster_tri *tris;
+  uint32_t tri_count;
+  uint32_t tri_capacity;
+
+  int clear_pending;
+  uint32_t clear_pixel;
+  uint32_t depth_epoch;
+
+  tile_worker *workers;
+  uint16_t worker_count;
+
+  SDL_mutex *lock;
+  SDL_cond *work_ready;
+  SDL_cond *work_done;
+  uint32_t generation;
+  uint16_t busy_workers;
+  int quit;
+  SDL_atomic_t next_tile;
+};
+
+static bbox2i tile_rect(const tile_binner *binner, uint32_t tile) {
+  int tx = (tile % binner->tiles_x) * TILE_SIZE;
+  int ty = (tile / binner->tiles_x) * TILE_SIZE;
+  bbox2i rect = {{tx, ty}, {tx + TILE_SIZE - 1, ty + TILE_SIZE - 1}};
+  if (rect.max[0] >= binner->surface->w)
+    rect.max[0] = binner->surface->w - 1;
+  if (rect.max[1] >= binner->surface->h)
+    rect.max[1] = binner->surface->h - 1;
+  return rect;
+}
+
+static void resolve_tile_depth(tile_binner *binner, tile_bin *bin,
+                               bbox2i rect) {
+  if (bin->depth_epoch == binner->depth_epoch)
+    return;
+  if (depth_format_bytes(binner->depth_format) == 4)
+    fill_rect_u32((uint32_t *)binner->zbuffer, binner->surface->pitch / 4,
+                  rect, 0xFFFFFFFF);
+  else
+    fill_rect_u16((uint16_t *)binner->zbuffer, binner->surface->pitch / 4,
+                  rect, 0xFFFF);
+  if (binner->hiz)
+    clear_hiz_buffer(binner->hiz, rect);
+  bin->depth_epoch = binner->depth_epoch;
+}
+
+static uint64_t rasterize_tiles(tile_binner *binner) {
+  uint32_t tile_count = (uint32_t)binner->tiles_x * binner->tiles_y;
+  uint64_t shaded = 0;
+
+  while (1) {
+    uint32_t tile = (uint32_t)SDL_AtomicAdd(&binner->next_tile, 1);
+    if (tile >= tile_count)
+      break;
+
+    tile_bin *bin = &binner->bins[tile];
+    bbox2i clip = tile_rect(binner, tile);
+
+    if (binner->clear_pending)
+      fill_rect_u32((uint32_t *)binner->surface->pixels,
+                    binner->surface->pitch / 4, clip, binner->clear_pixel);
+    if (bin->count > 0)
+      resolve_tile_depth(binner, bin, clip);
+
+    for (uint32_t i = 0; i < bin->count; i++)
+      shaded += rasterize_tri_zbuffered(binner->surface, binner->zbuffer,
+                                        &binner->tris[bin->tris[i]], clip);
+  }
+  return shaded;
+}
+
+static int tile_worker_main(void *data) {
+  tile_worker *worker = (tile_worker *)data;
+  tile_binner *binner = worker->binner;
+  uint32_t seen = 0;
+
+  SDL_LockMutex(binner->lock);
+  while (1) {
+    while (binner->generation == seen && !binner->quit)
+      SDL_CondWait(binner->work_ready, binner->lock);
+    if (binner->quit)
+      break;
+    seen = binner->generation;
+    SDL_UnlockMutex(binner->lock);
+
+    worker->pixels_shaded += rasterize_tiles(binner);
+
+    SDL_LockMutex(binner->lock);
+    if (--binner->busy_workers == 0)
+      SDL_CondSignal(binner->work_done);
+  }
+  SDL_UnlockMutex(binner->lock);
+  return 0;
+}
+
+tile_binner *allocate_tile_binner(SDL_Surface *surface, void *zbuffer,
+                                  int depth_format, hiz_buffer *hiz,
+                                  uint16_t thread_count) {
+  tile_binner *binner = (tile_binner *)calloc(1, sizeof(tile_binner));
+  VARIFYHEAP(binner, "allocate_tile_binner()", NULL);
+
+  binner->surface = surface;
+  binner->zbuffer = zbuffer;
+  binner->depth_format = depth_format;
+  binner->hiz = hiz;
+  binner->tiles_x = (surface->w + TILE_SIZE - 1) / TILE_SIZE;
+  binner->tiles_y = (surface->h + TILE_SIZE - 1) / TILE_SIZE;
+  binner->bins = (tile_bin *)calloc((size_t)binner->tiles_x * binner->tiles_y,
+                                    sizeof(tile_bin));
+  if (!binner->bins) {
+    printf("Heap allocation error: %s\n", "allocate_tile_binner()");
+    free(binner);
+    return NULL;
+  }
+
+  binner->lock = SDL_CreateMutex();
+  binner->work_ready = SDL_CreateCond();
+  binner->work_done = SDL_CreateCond();
+  if (!binner->lock || !binner->work_ready || !binner->work_done) {
+    SDL_Log("SDL Mutex Failure: %s", SDL_GetError());
+    if (binner->work_done)
+      SDL_DestroyCond(binner->work_done);
+    if (binner->work_ready)
+      SDL_DestroyCond(binner->work_ready);
+    if (binner->lock)
+      SDL_DestroyMutex(binner->lock);
+    free(binner->bins);
+    free(binner);
+    return NULL;
+  }
+
+  // The flushing thread rasterizes too, so only thread_count - 1 workers are
+  // spawned.
+  uint16_t worker_count = thread_count > 1 ? thread_count - 1 : 0;
+  if (worker_count > 0) {
+    binner->workers = (tile_worker *)calloc(worker_count, sizeof(tile_worker));
+    if (!binner->workers)
+      worker_count = 0;
+  }
+  for (uint16_t i = 0; i < worker_count; i++) {
+    binner->workers[i].binner = binner;
+    binner->workers[i].thread = SDL_CreateThread(tile_worker_main,
+                                                 "tile_worker",
+                                                 &binner->workers[i]);
+    if (!binner->workers[i].thread) {
+      SDL_Log("SDL Thread Failure: %s", SDL_GetError());
+      worker_count = i;
+      break;
+    }
+  }
+  binner->worker_count = worker_count;
+
+  return binner;
+}
+
+void deallocate_tile_binner(tile_binner *binner) {
+  VARIFYHEAP(binner, "deallocate_tile_binner()", );
+
+  SDL_LockMutex(binner->lock);
+  binner->quit = 1;
+  SDL_CondBroadcast(binner->work_ready);
+  SDL_UnlockMutex(binner->lock);
+  for (uint16_t i = 0; i < binner->worker_count; i++)
+    SDL_WaitThread(binner->workers[i].thread, NULL);
+
+  SDL_DestroyCond(binner->work_done);
+  SDL_DestroyCond(binner->work_ready);
+  SDL_DestroyMutex(binner->lock);
+
+  for (uint32_t i = 0; i < (uint32_t)binner->tiles_x * binner->tiles_y; i++)
+    free(binner->bins[i].tris);
+  free(binner->bins);
+  free(binner->tris);
+  free(binner->workers);
+  free(binner);
+}
+
+// Queues tri for every tile it touches. Returns 0, with nothing queued, if
+// the bins cannot grow to hold it; the caller must then draw it itself.
+int bin_raster_tri(tile_binner *binner, const raster_tri *tri) {
+  if (binner->tri_count == binner->tri_capacity) {
+    uint32_t capacity = binner->tri_capacity ? binner->tri_capacity * 2 : 1024;
+    raster_tri *tris =
+        (raster_tri *)realloc(binner->tris, capacity * sizeof(raster_tri));
+    VARIFYHEAP(tris, "bin_raster_tri()", 0);
+    binner->tris = tris;
+    binner->tri_capacity = capacity;
+  }
+
+  int min_x = tri->v[0][0], max_x = tri->v[0][0];
+  int min_y = tri->v[0][1], max_y = tri->v[0][1];
+  for (int i = 1; i < 3; i++) {
+    if (tri->v[i][0] < min_x)
+      min_x = tri->v[i][0];
+    if (tri->v[i][0] > max_x)
+      max_x = tri->v[i][0];
+    if (tri->v[i][1] < min_y)
+      min_y = tri->v[i][1];
+    if (tri->v[i][1] > max_y)
+      max_y = tri->v[i][1];
+  }
+  min_x >>= SUBPIXEL_BITS;
+  max_x >>= SUBPIXEL_BITS;
+  min_y >>= SUBPIXEL_BITS;
+  max_y >>= SUBPIXEL_BITS;
+  if (max_x < 0 || max_y < 0 || min_x >= binner->surface->w ||
+      min_y >= binner->surface->h)
+    return 1;
+
+  int tx0 = (min_x < 0 ? 0 : min_x) / TILE_SIZE;
+  int ty0 = (min_y < 0 ? 0 : min_y) / TILE_SIZE;
+  int tx1 = (max_x >= binner->surface->w ? binner->surface->w - 1 : max_x) /
+            TILE_SIZE;
+  int ty1 = (max_y >= binner->surface->h ? binner->surface->h - 1 : max_y) /
+            TILE_SIZE;
+
+  // Make room in every bin before adding to any, so a triangle is never
+  // left in only some of its tiles.
+  for (int ty = ty0; ty <= ty1; ty++)
+    for (int tx = tx0; tx <= tx1; tx++) {
+      tile_bin *bin = &binner->bins[ty * binner->tiles_x + tx];
+      if (bin->count == bin->capacity) {
+        uint32_t capacity = bin->capacity ? bin->capacity * 2 : 64;
+        uint32_t *items =
+            (uint32_t *)realloc(bin->tris, capacity * sizeof(uint32_t));
+        VARIFYHEAP(items, "bin_raster_tri()", 0);
+        bin->tris = items;
+        bin->capacity = capacity;
+      }
+    }
+
+  uint32_t index = binner->tri_count++;
+  binner->tris[index] = *tri;
+  for (int ty = ty0; ty <= ty1; ty++)
+    for (int tx = tx0; tx <= tx1; tx++) {
+      tile_bin *bin = &binner->bins[ty * binner->tiles_x + tx];
+      bin->tris[bin->count++] = index;
+    }
+  return 1;
+}
+
+void flush_tile_binner(tile_binner *binner) {
+  if (binner->tri_count == 0 && !binner->clear_pending)
+    return;
+
+  SDL_AtomicSet(&binner->next_tile, 0);
+  for (uint16_t i = 0; i < binner->worker_count; i++)
+    binner->workers[i].pixels_shaded = 0;
+
+  SDL_LockMutex(binner->lock);
+  binner->busy_workers = binner->worker_count;
+  binner->generation++;
+  SDL_CondBroadcast(binner->work_ready);
+  SDL_UnlockMutex(binner->lock);
+
+  render_stats delta = {0};
+  delta.pixels_shaded = rasterize_tiles(binner);
+
+  SDL_LockMutex(binner->lock);
+  while (binner->busy_workers > 0)
+    SDL_CondWait(binner->work_done, binner->lock);
+  SDL_UnlockMutex(binner->lock);
+
+  for (uint16_t i = 0; i < binner->worker_count; i++)
+    delta.pixels_shaded += binner->workers[i].pixels_shaded;
+  add_render_stats(&delta);
+
+  for (uint32_t i = 0; i < (uint32_t)binner->tiles_x * binner->tiles_y; i++)
+    binner->bins[i].count = 0;
+  binner->tri_count = 0;
+  binner->clear_pending = 0;
+}
+
+// Defers clearing the colour buffer to pixel and the zbuffer to the far
+// plane until the next flush. Triangles binned before this call are flushed
+// first so they are not lost.
+void clear_tile_binner(tile_binner *binner, uint32_t pixel) {
+  if (binner->tri_count > 0)
+    flush_tile_binner(binner);
+  binner->clear_pending = 1;
+  binner->clear_pixel = pixel;
+  binner->depth_epoch++;
+}
+
+// Flushes, then resets the depth of every tile still holding depth from
+// before the last clear. Call before reading the zbuffer outside the binner
+// or before dropping the binner.
+void resolve_tile_binner_depth(tile_binner *binner) {
+  flush_tile_binner(binner);
+  for (uint32_t i = 0; i < (uint32_t)binner->tiles_x * binner->tiles_y; i++)
+    resolve_tile_depth(binner, &binner->bins[i], tile_rect(binner, i));
+}